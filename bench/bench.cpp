@@ -0,0 +1,411 @@
+// dep-pull-bench: runs dep-pull against local stand-ins of everything it downloads (an HTTP server with synthetic
+// tarballs and a Debian archive, file:// git repositories) and reports what each run cost, so that performance
+// changes can be measured without depending on GitHub or a Debian mirror.
+//
+// Every scenario is a vendor.txt that is run three times: cold (empty cache, empty project), warm (the cache of the
+// cold run, empty project) and locked (again in the project of the warm run, which dep-pull.lock shows up to date).
+// Reported per run: wall time, CPU time, peak RSS of dep-pull, bytes served over HTTP, bytes
+// installed into the project, size of the cache and the time of every stage dep-pull reports with --timings.
+
+#include "fixtures.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <httplib.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern char** environ;
+
+struct BenchOptions {
+    std::string depPull;
+    fs::path work;
+    std::set<std::string> scenarios;
+    int runs = 1;
+    double scale = 1;
+    std::string json;
+    std::vector<std::string> depPullArgs;
+    bool help = false;
+};
+
+struct RunResult {
+    std::string scenario;
+    std::string run;
+    bool failed = false;
+    double wall = 0;
+    double user = 0;
+    double system = 0;
+    long peakRssKiB = 0;
+    uint64_t httpBytes = 0;
+    uint64_t installedBytes = 0;
+    uint64_t cacheBytes = 0;
+    std::vector<std::pair<std::string, double>> stages;
+};
+
+struct Scenario {
+    std::string name;
+    std::string vendorTxt;
+};
+
+namespace {
+    inline void printUsage() {
+        std::cout << "usage: dep-pull-bench [options] [-- dep-pull options]\n"
+                     "\n"
+                     "Runs dep-pull against a local HTTP server and local git repositories with synthetic content.\n"
+                     "\n"
+                     "  --dep-pull PATH   binary to measure (default: dep-pull next to this executable)\n"
+                     "  --work DIR        where fixtures, caches and projects are kept (default: ./bench-work),\n"
+                     "                    fixtures are generated once and reused while their sizes stay the same\n"
+                     "  --scenario NAME   only run this scenario, can be repeated:\n"
+                     "                    many-small-repos, huge-tarball, deep-deb\n"
+                     "  --runs N          repeat every scenario N times and report the median wall time (default 1)\n"
+                     "  --scale F         multiply the number of repositories, files and packages by F (default 1)\n"
+                     "  --json FILE       also write the results to FILE\n"
+                     "  -h, --help        show this message\n";
+    }
+
+    inline BenchOptions parseBenchArguments(int argc, char** argv) {
+        BenchOptions opt;
+        opt.depPull = (fs::absolute(fs::path(argv[0])).parent_path() / "dep-pull").string();
+        opt.work = fs::absolute("bench-work");
+        std::vector<std::string> args(argv + 1, argv + argc);
+        for (size_t i = 0; i < args.size(); i++) {
+            std::string arg = args[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= args.size()) throw std::runtime_error("missing value for " + arg);
+                return args[++i];
+            };
+            if (arg == "-h" || arg == "--help") {
+                opt.help = true;
+            } else if (arg == "--dep-pull") {
+                opt.depPull = fs::absolute(value()).string();
+            } else if (arg == "--work") {
+                opt.work = fs::absolute(value());
+            } else if (arg == "--scenario") {
+                opt.scenarios.insert(value());
+            } else if (arg == "--runs") {
+                opt.runs = std::stoi(value());
+                if (opt.runs < 1) throw std::runtime_error("--runs must be at least 1");
+            } else if (arg == "--scale") {
+                opt.scale = std::stod(value());
+                if (opt.scale <= 0) throw std::runtime_error("--scale must be positive");
+            } else if (arg == "--json") {
+                opt.json = value();
+            } else if (arg == "--") {
+                opt.depPullArgs.assign(args.begin() + i + 1, args.end());
+                break;
+            } else {
+                throw std::runtime_error("unknown argument " + arg + " (see --help)");
+            }
+        }
+        return opt;
+    }
+
+    // total size of the regular files below dir, hard links are counted once
+    inline uint64_t treeSize(fs::path dir) {
+        uint64_t total = 0;
+        std::set<std::pair<dev_t, ino_t>> seen;
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(dir, ec); !ec && it != fs::recursive_directory_iterator();
+             it.increment(ec)) {
+            struct stat st;
+            if (lstat(it->path().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (st.st_nlink > 1 && !seen.insert({st.st_dev, st.st_ino}).second) continue;
+            total += uint64_t(st.st_size);
+        }
+        return total;
+    }
+
+    inline std::string formatBytes(uint64_t bytes) {
+        const char* units[] = {"B", "KiB", "MiB", "GiB"};
+        double size = double(bytes);
+        int unit = 0;
+        while (size >= 1024 && unit < 3) {
+            size /= 1024;
+            unit++;
+        }
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << size << " " << units[unit];
+        return ss.str();
+    }
+
+    inline std::string jsonString(const std::string& s) {
+        std::string result = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') result += '\\';
+            result += c;
+        }
+        return result + "\"";
+    }
+} // namespace
+
+// Serves the files below root with Range support. httplib's own mount points read the whole file into memory for
+// every request, which would make the server the bottleneck of the big downloads, so files are streamed with pread.
+class FileServer {
+private:
+    httplib::Server server;
+    std::thread thread;
+    std::atomic<uint64_t> sent{0};
+    int port = 0;
+
+public:
+    FileServer(fs::path root) {
+        server.Get(R"(/(.*))", [this, root](const httplib::Request& req, httplib::Response& res) {
+            std::string path = req.matches[1].str();
+            fs::path file = root / path;
+            if (path.find("..") != std::string::npos || !fs::is_regular_file(file)) {
+                res.status = 404;
+                return;
+            }
+            auto fd = std::shared_ptr<int>(new int(open(file.c_str(), O_RDONLY | O_CLOEXEC)), [](int* fd) {
+                if (*fd >= 0) close(*fd);
+                delete fd;
+            });
+            if (*fd < 0) {
+                res.status = 500;
+                return;
+            }
+            res.set_content_provider(
+                size_t(fs::file_size(file)),
+                "application/octet-stream",
+                [this, fd](size_t offset, size_t length, httplib::DataSink& sink) {
+                    thread_local std::vector<char> buffer(1 << 20);
+                    ssize_t n = pread(*fd, buffer.data(), std::min(length, buffer.size()), off_t(offset));
+                    if (n <= 0) return false;
+                    if (!sink.write(buffer.data(), size_t(n))) return false;
+                    sent += uint64_t(n);
+                    return true;
+                }
+            );
+        });
+        // every kept alive connection holds a thread until it times out, the default pool of 8 would make dep-pull's
+        // ninth connection wait for 5 seconds
+        server.new_task_queue = [] { return new httplib::ThreadPool(64); };
+        port = server.bind_to_any_port("127.0.0.1");
+        if (port < 0) throw std::runtime_error("could not start the HTTP server");
+        thread = std::thread([this] { server.listen_after_bind(); });
+    }
+
+    ~FileServer() {
+        server.stop();
+        thread.join();
+    }
+
+    std::string url() const { return "http://127.0.0.1:" + std::to_string(port); }
+    uint64_t bytesSent() const { return sent; }
+};
+
+std::vector<Scenario> makeScenarios(const Fixtures& fixtures, const std::string& url) {
+    const FixtureSizes& sizes = fixtures.getSizes();
+    std::vector<Scenario> result;
+
+    std::ostringstream small;
+    for (int i = 0; i < sizes.gitRepos; i++) {
+        std::string name = "repo-" + std::to_string(i);
+        small << "git \"file://" << (fixtures.git() / (name + ".git")).string() << "\" main \"./src/\" \"./vendor/"
+              << name << "/\",\n";
+    }
+    for (int i = 0; i < sizes.smallTarballs; i++) {
+        std::string name = "small-" + std::to_string(i);
+        small << "tar \"" << url << "/" << name << ".tar.gz\" \"./" << name << "/include/\" \"./vendor/" << name
+              << "/\",\n";
+    }
+    result.push_back({"many-small-repos", small.str()});
+
+    result.push_back({"huge-tarball", "tar \"" + url + "/huge.tar.gz\" \"./huge/\" \"./vendor/huge/\",\n"});
+
+    std::ostringstream deb;
+    deb << "deb-init [\n    \"deb " << url << "/debian bench main\",\n],\n";
+    deb << "deb-recurse-limit " << sizes.debLevels + 2 << ",\n";
+    deb << "deb \"bench-root-a\" \"./usr/\" \"./vendor/deb-a/\",\n";
+    deb << "deb \"bench-root-b\" \"./usr/lib/\" \"./vendor/deb-b/\",\n";
+    result.push_back({"deep-deb", deb.str()});
+    return result;
+}
+
+// Runs dep-pull once in project with its cache in cache. The child is started with fork and execve directly, so its
+// peak RSS and CPU time come from wait4 and do not include the bench itself.
+RunResult runDepPull(const BenchOptions& opt, fs::path project, fs::path cache, FileServer& server) {
+    RunResult result;
+    fs::path log = project / "dep-pull.log";
+
+    // everything the child needs is prepared before fork, the server threads may hold the allocator lock
+    std::vector<std::string> args = {opt.depPull, "--timings"};
+    args.insert(args.end(), opt.depPullArgs.begin(), opt.depPullArgs.end());
+    std::vector<char*> argv;
+    for (auto& a : args) argv.push_back(a.data());
+    argv.push_back(nullptr);
+
+    std::vector<std::string> env;
+    for (char** e = environ; *e; e++) {
+        std::string entry = *e;
+        if (entry.rfind("DEP_PULL_CACHE_DIR=", 0) == 0 || entry.rfind("DEP_PULL_NO_CACHE=", 0) == 0) continue;
+        env.push_back(entry);
+    }
+    env.push_back("DEP_PULL_CACHE_DIR=" + cache.string());
+    std::vector<char*> envp;
+    for (auto& e : env) envp.push_back(e.data());
+    envp.push_back(nullptr);
+
+    std::string directory = project.string();
+    int logFd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (logFd < 0) throw std::runtime_error("failed to create " + log.string() + ": " + std::strerror(errno));
+
+    uint64_t sentBefore = server.bytesSent();
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error(std::string("fork failed: ") + std::strerror(errno));
+    if (pid == 0) {
+        if (chdir(directory.c_str()) != 0 || dup2(logFd, 1) < 0 || dup2(logFd, 2) < 0) _exit(127);
+        execve(argv[0], argv.data(), envp.data());
+        _exit(127);
+    }
+    close(logFd);
+
+    int status = 0;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) throw std::runtime_error(std::string("wait4 failed: ") + std::strerror(errno));
+    }
+    result.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    result.system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result.peakRssKiB = usage.ru_maxrss;
+    result.httpBytes = server.bytesSent() - sentBefore;
+    result.installedBytes = treeSize(project / "vendor");
+    result.cacheBytes = treeSize(cache);
+    result.failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+    // dep-pull reports failed statements on stdout and still exits with 0
+    std::ifstream in(log);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("[ERROR]") != std::string::npos) result.failed = true;
+        std::istringstream fields(line);
+        std::string word, name;
+        double seconds;
+        if (fields >> word >> name >> seconds && word == "Stage") result.stages.push_back({name, seconds});
+    }
+    if (result.failed) std::cout << "[WARNING] dep-pull failed, see " << log.string() << std::endl;
+    return result;
+}
+
+void printResult(const RunResult& r) {
+    std::cout << std::left << std::setw(18) << r.scenario << std::setw(7) << r.run << std::right << std::fixed
+              << std::setprecision(2) << std::setw(8) << r.wall << "s" << std::setw(8) << r.user << "s" << std::setw(7)
+              << r.system << "s" << std::setw(11) << formatBytes(uint64_t(r.peakRssKiB) * 1024) << std::setw(11)
+              << formatBytes(r.httpBytes) << std::setw(11) << formatBytes(r.installedBytes) << std::setw(11)
+              << formatBytes(r.cacheBytes) << "  ";
+    for (auto& [name, seconds] : r.stages) std::cout << name << " " << std::setprecision(2) << seconds << "s  ";
+    if (r.failed) std::cout << "FAILED";
+    std::cout << std::defaultfloat << std::endl;
+}
+
+void printHeader() {
+    std::cout << std::left << std::setw(18) << "scenario" << std::setw(7) << "run" << std::right << std::setw(9)
+              << "wall" << std::setw(9) << "user" << std::setw(8) << "sys" << std::setw(11) << "peak RSS"
+              << std::setw(11) << "http" << std::setw(11) << "installed" << std::setw(11) << "cache"
+              << "  stages" << std::endl;
+}
+
+void writeJson(const std::string& file, const BenchOptions& opt, const std::vector<RunResult>& results) {
+    std::ofstream out(file);
+    out << "{\n  \"dep-pull\": " << jsonString(opt.depPull) << ",\n  \"scale\": " << opt.scale
+        << ",\n  \"runs\": " << opt.runs << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto& r = results[i];
+        out << "    {\"scenario\": " << jsonString(r.scenario) << ", \"run\": " << jsonString(r.run)
+            << ", \"failed\": " << (r.failed ? "true" : "false") << ", \"wall\": " << r.wall << ", \"user\": " << r.user
+            << ", \"system\": " << r.system << ", \"peak_rss_kib\": " << r.peakRssKiB
+            << ", \"http_bytes\": " << r.httpBytes << ", \"installed_bytes\": " << r.installedBytes
+            << ", \"cache_bytes\": " << r.cacheBytes << ", \"stages\": {";
+        for (size_t k = 0; k < r.stages.size(); k++) {
+            out << (k ? ", " : "") << jsonString(r.stages[k].first) << ": " << r.stages[k].second;
+        }
+        out << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    try {
+        BenchOptions opt = parseBenchArguments(argc, argv);
+        if (opt.help) {
+            printUsage();
+            return 0;
+        }
+        if (access(opt.depPull.c_str(), X_OK) != 0) throw std::runtime_error("can not execute " + opt.depPull);
+
+        FixtureSizes sizes;
+        sizes.scale(opt.scale);
+        Fixtures fixtures(opt.work / "fixtures", sizes);
+        fixtures.generate();
+        FileServer server(fixtures.www());
+
+        auto scenarios = makeScenarios(fixtures, server.url());
+        for (auto& name : opt.scenarios) {
+            if (std::none_of(scenarios.begin(), scenarios.end(), [&](const Scenario& s) { return s.name == name; }))
+                throw std::runtime_error("unknown scenario " + name);
+        }
+
+        std::vector<RunResult> results;
+        printHeader();
+        for (auto& scenario : scenarios) {
+            if (!opt.scenarios.empty() && !opt.scenarios.count(scenario.name)) continue;
+
+            std::map<std::string, std::vector<RunResult>> repetitions;
+            for (int repetition = 0; repetition < opt.runs; repetition++) {
+                fs::path cache = opt.work / "cache" / scenario.name;
+                fs::remove_all(cache);
+                for (std::string run : {"cold", "warm", "locked"}) {
+                    fs::path project = opt.work / "projects" / scenario.name / (run == "locked" ? "warm" : run);
+                    if (run != "locked") {
+                        fs::remove_all(project);
+                        fs::create_directories(project);
+                        std::ofstream(project / "vendor.txt") << scenario.vendorTxt;
+                    }
+
+                    RunResult r = runDepPull(opt, project, cache, server);
+                    r.scenario = scenario.name;
+                    r.run = run;
+                    if (opt.runs > 1) std::cout << "  " << repetition + 1 << "/" << opt.runs << " ";
+                    printResult(r);
+                    repetitions[run].push_back(r);
+                }
+            }
+            for (std::string run : {"cold", "warm", "locked"}) {
+                auto& all = repetitions[run];
+                std::sort(all.begin(), all.end(), [](auto& a, auto& b) { return a.wall < b.wall; });
+                results.push_back(all[all.size() / 2]);
+            }
+        }
+
+        if (opt.runs > 1) {
+            std::cout << "\nmedian of " << opt.runs << " runs\n";
+            printHeader();
+            for (auto& r : results) printResult(r);
+        }
+        if (!opt.json.empty()) writeJson(opt.json, opt, results);
+        bool failed = std::any_of(results.begin(), results.end(), [](auto& r) { return r.failed; });
+        return failed ? 1 : 0;
+    } catch (std::exception& e) {
+        std::cout << "[ERROR] " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include "hash.hpp"
+#include <ar/ar.hpp>
+#include <bxzstr.hpp>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <subprocess/subprocess.hpp>
+#include <tar/tar.hpp>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// How much the synthetic repositories contain, scale() multiplies the counts (not the file sizes).
+struct FixtureSizes {
+    int gitRepos = 24;
+    int gitFiles = 100;
+    size_t gitFileSize = 2 << 10;
+    int smallTarballs = 24;
+    int smallTarFiles = 100;
+    int hugeFiles = 2048;
+    size_t hugeFileSize = 128 << 10;
+    int debLevels = 8; // length of the longest dependency chain
+    int debWidth = 6;  // packages per level
+    size_t debLibrarySize = 64 << 10;
+
+    void scale(double factor) {
+        for (int* count : {&gitRepos, &smallTarballs, &hugeFiles, &debWidth}) {
+            *count = std::max(1, int(*count * factor));
+        }
+    }
+};
+
+// deterministic text that compresses about as well as source code (3-4x), fast enough for hundreds of MiB
+class ContentGenerator {
+private:
+    uint64_t state;
+    std::vector<std::string> words;
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+public:
+    ContentGenerator(uint64_t seed) : state(seed * 0x9e3779b97f4a7c15ull + 1) {
+        const char* letters = "etaoinshrdlucmfwypvbgkqjxz_";
+        for (int i = 0; i < 512; i++) {
+            std::string w;
+            int length = 2 + int(next() % 9);
+            for (int k = 0; k < length; k++) w += letters[next() % (k == 0 ? 26 : 27)];
+            words.push_back(w);
+        }
+    }
+
+    std::string text(size_t size) {
+        std::string result;
+        result.reserve(size + 16);
+        size_t lineStart = 0;
+        while (result.size() < size) {
+            uint64_t r = next();
+            result += words[r % words.size()];
+            if (result.size() - lineStart > 40 + (r >> 32) % 60) {
+                result += (r >> 20) % 4 == 0 ? ";\n" : "\n";
+                lineStart = result.size();
+            } else {
+                result += (r >> 24) % 8 == 0 ? "(" : " ";
+            }
+        }
+        result.resize(size);
+        return result;
+    }
+};
+
+inline void runChecked(std::vector<std::string> args) {
+    using namespace subprocess;
+    auto p = Popen(args, output{PIPE}, error{PIPE});
+    auto comm = p.communicate();
+    if (p.retcode() != 0) {
+        std::string err(comm.second.buf.data(), std::max(0, int(comm.second.length)));
+        throw std::runtime_error(args[0] + " " + args[1] + " failed: " + err);
+    }
+}
+
+inline void writeTarball(fs::path file, bxz::Compression compression, std::function<void(tar::Writer&)> members) {
+    fs::create_directories(file.parent_path());
+    std::ofstream raw(file, std::ios::binary | std::ios::trunc);
+    if (!raw) throw std::runtime_error("failed to create " + file.string());
+    {
+        bxz::ostream out(raw, compression, compression == bxz::z ? 6 : 3);
+        tar::Writer tar(out);
+        members(tar);
+        tar.finish();
+    }
+    raw.close();
+}
+
+inline std::string compressed(const std::string& data, bxz::Compression compression) {
+    std::ostringstream raw;
+    {
+        bxz::ostream out(raw, compression, 6);
+        out.write(data.data(), data.size());
+    }
+    return raw.str();
+}
+
+// Generates the repositories dep-pull-bench serves: tarballs and a Debian archive below www() for the HTTP server
+// and bare git repositories below git() for file:// urls. Everything is derived from fixed seeds, two runs of the
+// bench with the same sizes use identical inputs. Existing files are reused when the sizes did not change.
+class Fixtures {
+private:
+    fs::path root;
+    FixtureSizes sizes;
+
+    std::string sizesKey() const {
+        std::ostringstream ss;
+        ss << sizes.gitRepos << " " << sizes.gitFiles << " " << sizes.gitFileSize << " " << sizes.smallTarballs << " "
+           << sizes.smallTarFiles << " " << sizes.hugeFiles << " " << sizes.hugeFileSize << " " << sizes.debLevels
+           << " " << sizes.debWidth << " " << sizes.debLibrarySize;
+        return ss.str();
+    }
+
+    void createGitRepo(int n) {
+        fs::path work = root / "git-work" / ("repo-" + std::to_string(n));
+        fs::path bare = git() / ("repo-" + std::to_string(n) + ".git");
+        fs::remove_all(work);
+        fs::remove_all(bare);
+        ContentGenerator content(1000 + n);
+        for (int i = 0; i < sizes.gitFiles; i++) {
+            fs::path file = work / "src" / ("module-" + std::to_string(i % 8)) / ("file-" + std::to_string(i) + ".cpp");
+            fs::create_directories(file.parent_path());
+            std::ofstream(file, std::ios::binary) << content.text(sizes.gitFileSize);
+        }
+        std::ofstream(work / "README") << "repo " << n << "\n";
+
+        std::string w = work.string();
+        runChecked({"git", "-c", "init.defaultBranch=main", "init", "-q", w});
+        runChecked({"git", "-C", w, "add", "-A"});
+        runChecked(
+            {"git", "-C", w, "-c", "user.name=bench", "-c", "user.email=bench@localhost", "commit", "-q", "-m", "init"}
+        );
+        runChecked({"git", "clone", "-q", "--bare", w, bare.string()});
+        // what a hosted server allows, the fetcher asks for blob:none partial clones
+        runChecked({"git", "-C", bare.string(), "config", "uploadpack.allowFilter", "true"});
+        runChecked({"git", "-C", bare.string(), "config", "uploadpack.allowAnySHA1InWant", "true"});
+        fs::remove_all(work);
+    }
+
+    void createSmallTarball(int n) {
+        ContentGenerator content(2000 + n);
+        std::string top = "./small-" + std::to_string(n) + "/";
+        writeTarball(www() / ("small-" + std::to_string(n) + ".tar.gz"), bxz::z, [&](tar::Writer& tar) {
+            tar.directory("./");
+            tar.directory(top);
+            tar.directory(top + "include/");
+            for (int i = 0; i < sizes.smallTarFiles; i++) {
+                tar.file(top + "include/header-" + std::to_string(i) + ".h", content.text(sizes.gitFileSize));
+            }
+        });
+    }
+
+    void createHugeTarball() {
+        ContentGenerator content(3000);
+        writeTarball(www() / "huge.tar.gz", bxz::z, [&](tar::Writer& tar) {
+            tar.directory("./");
+            tar.directory("./huge/");
+            for (int d = 0; d < 16; d++) tar.directory("./huge/dir-" + std::to_string(d) + "/");
+            for (int i = 0; i < sizes.hugeFiles; i++) {
+                std::string dir = "./huge/dir-" + std::to_string(i % 16) + "/";
+                tar.file(dir + "blob-" + std::to_string(i) + ".dat", content.text(sizes.hugeFileSize));
+            }
+        });
+    }
+
+    // A layered dependency graph: every package of a level depends on two packages of the next one, so the closure
+    // of a root is deep and most packages are reached on several paths. Each .deb carries a shared library with its
+    // .so symlink, headers and a copyright file, like a -dev package.
+    void createDebArchive() {
+        fs::path archive = www() / "debian";
+        fs::remove_all(archive);
+        fs::path pool = archive / "pool" / "main";
+        fs::create_directories(pool);
+
+        std::ostringstream packages;
+        auto addPackage = [&](const std::string& name, std::vector<std::string> depends, uint64_t seed) {
+            ContentGenerator content(seed);
+            std::ostringstream dataTar;
+            {
+                tar::Writer tar(dataTar);
+                for (auto dir : {"./", "./usr/", "./usr/lib/", "./usr/include/", "./usr/share/", "./usr/share/doc/"})
+                    tar.directory(dir);
+                tar.directory("./usr/include/" + name + "/");
+                tar.directory("./usr/share/doc/" + name + "/");
+                tar.file("./usr/lib/lib" + name + ".so.1", content.text(sizes.debLibrarySize));
+                tar.symlink("./usr/lib/lib" + name + ".so", "lib" + name + ".so.1");
+                for (int i = 0; i < 10; i++) {
+                    tar.file("./usr/include/" + name + "/" + std::to_string(i) + ".h", content.text(4 << 10));
+                }
+                tar.file("./usr/share/doc/" + name + "/copyright", "synthetic package\n");
+                tar.finish();
+            }
+            std::string control = "Package: " + name + "\nVersion: 1.0\nArchitecture: amd64\n";
+            std::ostringstream controlTar;
+            {
+                tar::Writer tar(controlTar);
+                tar.file("./control", control);
+                tar.finish();
+            }
+
+            fs::path file = pool / (name + "_1.0_amd64.deb");
+            {
+                std::ofstream out(file, std::ios::binary | std::ios::trunc);
+                ar::Writer deb(out);
+                deb.add("debian-binary", "2.0\n");
+                deb.add("control.tar.gz", compressed(controlTar.str(), bxz::z));
+                deb.add("data.tar.xz", compressed(dataTar.str(), bxz::lzma));
+            }
+
+            packages << control;
+            if (!depends.empty()) {
+                packages << "Depends: ";
+                for (size_t i = 0; i < depends.size(); i++) packages << (i ? ", " : "") << depends[i] << " (>= 1.0)";
+                packages << "\n";
+            }
+            packages << "Filename: pool/main/" << file.filename().string() << "\nSize: " << fs::file_size(file)
+                     << "\nSHA256: " << sha256File(file.string()) << "\nDescription: synthetic package\n\n";
+        };
+
+        auto packageName = [](int level, int i) { return "bench-l" + std::to_string(level) + "-" + std::to_string(i); };
+        for (int level = 0; level < sizes.debLevels; level++) {
+            for (int i = 0; i < sizes.debWidth; i++) {
+                std::vector<std::string> depends;
+                if (level + 1 < sizes.debLevels) {
+                    depends.push_back(packageName(level + 1, i));
+                    if (sizes.debWidth > 1) depends.push_back(packageName(level + 1, (i + 1) % sizes.debWidth));
+                }
+                addPackage(packageName(level, i), depends, 4000 + level * 1000 + i);
+            }
+        }
+        // two roots that share most of their closure, installed by different statements
+        addPackage("bench-root-a", {packageName(0, 0)}, 10);
+        addPackage("bench-root-b", {packageName(0, sizes.debWidth / 2), packageName(0, 0)}, 11);
+
+        fs::path lists = archive / "dists" / "bench" / "main" / "binary-amd64";
+        fs::create_directories(lists);
+        std::ofstream(lists / "Packages.gz", std::ios::binary) << compressed(packages.str(), bxz::z);
+    }
+
+public:
+    Fixtures(fs::path root, FixtureSizes sizes) : root(root), sizes(sizes) {}
+
+    fs::path www() const { return root / "www"; }
+    fs::path git() const { return root / "git"; }
+    const FixtureSizes& getSizes() const { return sizes; }
+
+    void generate() {
+        fs::path stamp = root / "sizes";
+        std::string key = sizesKey();
+        {
+            std::ifstream in(stamp);
+            std::string existing;
+            if (std::getline(in, existing) && existing == key) return;
+        }
+        fs::remove_all(www());
+        fs::remove_all(git());
+        fs::create_directories(www());
+        fs::create_directories(git());
+
+        std::cout << "generating fixtures in " << root.string() << std::endl;
+        for (int i = 0; i < sizes.gitRepos; i++) createGitRepo(i);
+        for (int i = 0; i < sizes.smallTarballs; i++) createSmallTarball(i);
+        createHugeTarball();
+        createDebArchive();
+        std::ofstream(stamp) << key << "\n";
+    }
+};
@@ -0,0 +1,384 @@
+#pragma once
+
+#include "hash.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <estd/filesystem.hpp>
+#include <estd/ptr.hpp>
+#include <estd/string_util.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/file.h>
+#include <unistd.h>
+#include <vector>
+
+using estd::files::Path;
+using namespace estd::shortnames;
+
+// flock based lock, every instance owns its own descriptor so it also excludes threads of the same process
+class FileLock {
+private:
+    int fd = -1;
+
+public:
+    FileLock(Path p, bool exclusive = true, bool wait = true, bool create = true) {
+        fd = ::open(p.string().c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (fd < 0) {
+            if (create) throw std::runtime_error("could not open lock file " + p.string());
+            return;
+        }
+        int op = (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB);
+        if (::flock(fd, op) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+    ~FileLock() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool locked() { return fd >= 0; }
+};
+
+inline int64_t unixTime() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// remove_all fails on read only directories that come out of some archives
+inline void removeTree(Path p) {
+    std::error_code ec;
+    if (std::filesystem::is_directory(std::filesystem::symlink_status(p.string()))) {
+        for (auto& e : std::filesystem::recursive_directory_iterator(p.string(), ec)) {
+            if (e.is_directory() && !e.is_symlink()) {
+                std::filesystem::permissions(
+                    e.path(), std::filesystem::perms::owner_all, std::filesystem::perm_options::add, ec
+                );
+            }
+        }
+        std::filesystem::permissions(
+            p.string(), std::filesystem::perms::owner_all, std::filesystem::perm_options::add, ec
+        );
+    }
+    std::filesystem::remove_all(p.string(), ec);
+}
+
+inline uint64_t parseByteSize(std::string s) {
+    if (s.empty()) throw std::runtime_error("empty size");
+    uint64_t multiplier = 1;
+    switch (toupper(s.back())) {
+        case 'K': multiplier = 1ull << 10; break;
+        case 'M': multiplier = 1ull << 20; break;
+        case 'G': multiplier = 1ull << 30; break;
+        case 'T': multiplier = 1ull << 40; break;
+    }
+    if (multiplier != 1) s.pop_back();
+    return std::stoull(s) * multiplier;
+}
+
+// how long the entries of a repoId can be used: .deb files with a checksum never change, tarballs are kept until
+// --update (their url is all there is to go by, and their index and tree must come from the same download), the rest
+// (git refs, deb statements) is fetched again after the ttl or with --update. Git statements whose ref is a commit
+// are pinned by the caller, only the mirror knows what a ref resolved to.
+enum class Expiry { never, update, ttl };
+
+inline Expiry repoIdExpiry(const std::string& repoId) {
+    std::stringstream ss(repoId);
+    std::string kind, url, ref;
+    ss >> kind >> url >> ref;
+    if (kind == "deb-package" && ref.size() == 64 && isHexString(ref)) return Expiry::never;
+    if (kind == "tar") return Expiry::update;
+    return Expiry::ttl;
+}
+
+// Persistent content-addressed store shared between runs (and between processes running at the same time).
+//
+// <root>/objects/trees/<hash>/    immutable extracted trees, <hash> is the sha256 of the tree contents
+// <root>/objects/files/<hash>     immutable downloaded files, <hash> is the sha256 of the file
+// <root>/objects/*/<hash>.meta    size of the object, the mtime is used as the last access time for LRU eviction
+// <root>/refs/<sha256(key)>       maps a repoId (+ source path) to the objects above
+// <root>/locks/, <root>/tmp/      creation locks and staging area (same filesystem so commits are a rename)
+class ArtifactStore {
+private:
+    struct RefEntry {
+        std::string kind;
+        int64_t created = 0;
+        std::string hash;
+        std::string sourcePath;
+    };
+
+    Path rootDir;
+    uint64_t maxSize;
+    int64_t ttl;
+    std::mutex pinLock;
+    std::vector<std::unique_ptr<FileLock>> pins; // shared locks on objects used by this process
+
+    Path refPath(const std::string& key) { return rootDir / "refs" / sha256Hex(key); }
+    Path treePath(const std::string& hash) { return rootDir / "objects" / "trees" / hash; }
+    Path filePath(const std::string& hash) { return rootDir / "objects" / "files" / hash; }
+    Path metaPath(Path object) { return object.string() + ".meta"; }
+
+    std::vector<RefEntry> readRef(const std::string& key) {
+        std::vector<RefEntry> result;
+        std::ifstream f(refPath(key).string());
+        std::string line;
+        while (std::getline(f, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            auto parts = estd::string_util::splitAll(line, "\t");
+            if (parts.size() < 3) continue;
+            RefEntry e;
+            e.kind = parts[0];
+            e.created = std::stoll(parts[1]);
+            e.hash = parts[2];
+            if (parts.size() > 3) e.sourcePath = parts[3];
+            result.push_back(e);
+        }
+        return result;
+    }
+
+    // must be called with store.lock held
+    void addRefEntry(const std::string& key, RefEntry entry) {
+        auto entries = readRef(key);
+        entries.erase(
+            std::remove_if(
+                entries.begin(),
+                entries.end(),
+                [&](RefEntry& e) { return e.kind == entry.kind && e.sourcePath == entry.sourcePath; }
+            ),
+            entries.end()
+        );
+        entries.push_back(entry);
+
+        Path tmp = refPath(key).string() + ".tmp";
+        {
+            std::ofstream f(tmp.string());
+            f << "# " << estd::string_util::replace_all(key, "\n", " ") << "\n";
+            for (auto& e : entries) f << e.kind << "\t" << e.created << "\t" << e.hash << "\t" << e.sourcePath << "\n";
+            if (!f) throw std::runtime_error("store: could not write ref " + tmp.string());
+        }
+        std::filesystem::rename(tmp.string(), refPath(key).string());
+    }
+
+    bool isFresh(const std::string& key, const RefEntry& e, bool pinned) {
+        Expiry expiry = pinned ? Expiry::never : repoIdExpiry(key);
+        if (expiry == Expiry::never) return true;
+        if (e.created < staleBefore) return false;
+        return expiry == Expiry::update || unixTime() - e.created < ttl;
+    }
+
+    // takes a shared lock on the object so that other processes do not evict it while we copy from it
+    bool pin(Path object) {
+        auto lock = std::make_unique<FileLock>(metaPath(object), false, true, false);
+        if (!lock->locked() || !std::filesystem::exists(object.string())) return false;
+        std::error_code ec;
+        std::filesystem::last_write_time(metaPath(object).string(), std::filesystem::file_time_type::clock::now(), ec);
+        std::lock_guard<std::mutex> l(pinLock);
+        pins.push_back(std::move(lock));
+        return true;
+    }
+
+    Path makeStaging() {
+        Path p = rootDir / "tmp" / (std::to_string(getpid()) + "-" + estd::string_util::gen_random(10));
+        std::filesystem::create_directories(p.string());
+        return p;
+    }
+
+    // sha256 over the sorted listing (path, type, contents) of a directory
+    static std::string hashTree(Path dir, uint64_t& size) {
+        std::vector<std::filesystem::path> entries;
+        for (auto& e : std::filesystem::recursive_directory_iterator(dir.string())) entries.push_back(e.path());
+        std::sort(entries.begin(), entries.end());
+
+        Sha256 sha;
+        size = 0;
+        for (auto& e : entries) {
+            auto status = std::filesystem::symlink_status(e);
+            sha.update(std::filesystem::relative(e, dir.string()).generic_string() + '\0');
+            if (std::filesystem::is_symlink(status)) {
+                sha.update("l" + std::filesystem::read_symlink(e).string() + '\0');
+            } else if (std::filesystem::is_directory(status)) {
+                sha.update("d", 1);
+            } else if (std::filesystem::is_regular_file(status)) {
+                sha.update("f", 1);
+                sha.updateFile(e);
+                size += std::filesystem::file_size(e);
+            }
+        }
+        return sha.hexDigest();
+    }
+
+    Path commit(Path staging, Path object, uint64_t size) {
+        if (!std::filesystem::exists(object.string())) {
+            std::filesystem::rename(staging.string(), object.string());
+            std::ofstream(metaPath(object).string()) << size << "\n";
+        } else {
+            removeTree(staging);
+        }
+        if (!pin(object)) throw std::runtime_error("store: object disappeared while committing " + object.string());
+        return object;
+    }
+
+public:
+    ArtifactStore(Path root, uint64_t maxSize = 10ull << 30, int64_t ttl = 24 * 60 * 60) :
+        rootDir(root), maxSize(maxSize), ttl(ttl) {
+        for (auto dir : {"refs", "objects/trees", "objects/files", "locks", "tmp"})
+            std::filesystem::create_directories((rootDir / dir).string());
+    }
+
+    // DEP_PULL_CACHE_DIR, then $XDG_CACHE_HOME/dep-pull, then ~/.cache/dep-pull
+    static Path defaultRoot() {
+        if (const char* dir = std::getenv("DEP_PULL_CACHE_DIR"); dir && *dir) return Path(dir);
+        if (const char* dir = std::getenv("XDG_CACHE_HOME"); dir && *dir) return Path(dir) / "dep-pull";
+        if (const char* dir = std::getenv("HOME"); dir && *dir) return Path(dir) / ".cache" / "dep-pull";
+        return estd::files::currentPath() / ".dep-pull-cache";
+    }
+
+    // configured through DEP_PULL_CACHE_SIZE (bytes, or with a K/M/G/T suffix) and DEP_PULL_CACHE_TTL (seconds)
+    static jptr<ArtifactStore> fromEnvironment() {
+        uint64_t size = 10ull << 30;
+        int64_t ttl = 24 * 60 * 60;
+        if (const char* s = std::getenv("DEP_PULL_CACHE_SIZE"); s && *s) size = parseByteSize(s);
+        if (const char* s = std::getenv("DEP_PULL_CACHE_TTL"); s && *s) ttl = std::stoll(s);
+        return new ArtifactStore(defaultRoot(), size, ttl);
+    }
+
+    Path root() { return rootDir; }
+
+    // seconds after which refs are resolved again (DEP_PULL_CACHE_TTL)
+    int64_t maxAge() const { return ttl; }
+
+    // entries created before this unix time are not used unless they are pinned, --update sets it to the start of the
+    // run so that branches, tarballs and deb statements are fetched again once
+    int64_t staleBefore = 0;
+
+    // lets other processes evict the objects this one used so far, a daemon calls it after every run
+    void unpinAll() {
+        std::lock_guard<std::mutex> l(pinLock);
+        pins.clear();
+    }
+
+    // pinned entries are used however old they are
+    sptr<Path> findTree(const std::string& key, Path sourcePath, bool pinned = false) {
+        for (auto& e : readRef(key)) {
+            if (e.kind != "tree" || !isFresh(key, e, pinned)) continue;
+            if (!Path(e.sourcePath).contains(sourcePath)) continue;
+            if (pin(treePath(e.hash))) return treePath(e.hash);
+        }
+        return nullptr;
+    }
+
+    // creationFunc fills an empty staging directory, the result is committed atomically
+    Path createTree(
+        const std::string& key, Path sourcePath, std::function<void(Path)> creationFunc, bool pinned = false
+    ) {
+        FileLock keyLock(rootDir / "locks" / (sha256Hex(key) + ".lock"));
+        // someone else created it while we waited
+        if (auto tree = findTree(key, sourcePath, pinned)) return tree.value();
+
+        Path staging = makeStaging();
+        try {
+            creationFunc(staging);
+        } catch (...) {
+            removeTree(staging);
+            throw;
+        }
+        uint64_t size = 0;
+        std::string hash = hashTree(staging, size);
+
+        Path tree;
+        {
+            FileLock storeLock(rootDir / "store.lock");
+            tree = commit(staging, treePath(hash), size);
+            addRefEntry(key, {"tree", unixTime(), hash, sourcePath.normalize().string()});
+        }
+        evict();
+        return tree;
+    }
+
+    sptr<Path> findFile(const std::string& key) {
+        for (auto& e : readRef(key)) {
+            if (e.kind != "file" || !isFresh(key, e, false)) continue;
+            if (pin(filePath(e.hash))) return filePath(e.hash);
+        }
+        return nullptr;
+    }
+
+    // creationFunc writes the file to the path it is given
+    Path createFile(const std::string& key, std::function<void(Path)> creationFunc) {
+        FileLock keyLock(rootDir / "locks" / (sha256Hex(key) + ".file.lock"));
+        if (auto file = findFile(key)) return file.value();
+
+        Path staging = makeStaging();
+        Path stagedFile = staging / "file";
+        try {
+            creationFunc(stagedFile);
+            if (!std::filesystem::exists(stagedFile.string()))
+                throw std::runtime_error("store: nothing was created for " + key);
+        } catch (...) {
+            removeTree(staging);
+            throw;
+        }
+        uint64_t size = std::filesystem::file_size(stagedFile.string());
+        std::string hash = sha256File(stagedFile);
+
+        Path file;
+        {
+            FileLock storeLock(rootDir / "store.lock");
+            file = commit(stagedFile, filePath(hash), size);
+            addRefEntry(key, {"file", unixTime(), hash, ""});
+        }
+        removeTree(staging);
+        evict();
+        return file;
+    }
+
+    // least recently used objects go first, objects pinned by any running process are skipped
+    void evict() {
+        struct Object {
+            Path path;
+            uint64_t size = 0;
+            std::filesystem::file_time_type lastUse;
+        };
+
+        FileLock storeLock(rootDir / "store.lock");
+        std::vector<Object> objects;
+        uint64_t total = 0;
+        for (auto kind : {"objects/trees", "objects/files"}) {
+            for (auto& e : std::filesystem::directory_iterator((rootDir / kind).string())) {
+                if (e.path().extension() != ".meta") continue;
+                Object o;
+                o.path = (e.path().parent_path() / e.path().stem()).string();
+                std::ifstream(e.path()) >> o.size;
+                o.lastUse = std::filesystem::last_write_time(e.path());
+                total += o.size;
+                objects.push_back(o);
+            }
+        }
+
+        auto yesterday = std::filesystem::file_time_type::clock::now() - std::chrono::hours(24);
+        for (auto& e : std::filesystem::directory_iterator((rootDir / "tmp").string())) {
+            std::error_code ec;
+            if (std::filesystem::last_write_time(e.path(), ec) < yesterday) removeTree(e.path());
+        }
+
+        if (total <= maxSize) return;
+        std::sort(objects.begin(), objects.end(), [](Object& a, Object& b) { return a.lastUse < b.lastUse; });
+        for (auto& o : objects) {
+            if (total <= maxSize) break;
+            FileLock inUse(metaPath(o.path), true, false, false);
+            if (!inUse.locked()) continue;
+            removeTree(o.path);
+            std::filesystem::remove(metaPath(o.path).string());
+            total -= o.size;
+        }
+    }
+};
@@ -0,0 +1,362 @@
+#pragma once
+
+#include "hash.hpp"
+#include "install-manifest.hpp"
+#include "parallel-decompress.hpp"
+#include "scheduler.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <sys/stat.h>
+#include <tar/tar.hpp>
+#include <utility>
+#include <vector>
+#include <zstd.h>
+
+// Compresses what is written to it into independent zstd frames of frameSize bytes each, several of them at once on
+// the cpu lane. ParallelDecompressBuf cuts the result at the frame boundaries and decodes it in parallel again.
+class ParallelZstdWriter : public std::streambuf {
+private:
+    static constexpr size_t frameSize = 4 << 20;
+
+    std::ostream& out;
+    int level;
+    int threads;
+    std::string chunk;
+    std::deque<std::future<std::string>> pending;
+    uint64_t written = 0;
+
+    static std::string compress(const std::string& data, int level) {
+        std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+        ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_checksumFlag, 1);
+        std::string frame(ZSTD_compressBound(data.size()), '\0');
+        size_t n = ZSTD_compress2(cctx.get(), frame.data(), frame.size(), data.data(), data.size());
+        if (ZSTD_isError(n)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(n));
+        frame.resize(n);
+        return frame;
+    }
+
+    void writeNext() {
+        std::string frame = pending.front().get();
+        pending.pop_front();
+        out.write(frame.data(), std::streamsize(frame.size()));
+        written += frame.size();
+    }
+
+    void submit() {
+        if (chunk.empty()) return;
+        tracer.count("bytes compressed", int64_t(chunk.size()));
+        pending.push_back(scheduler.async(Lane::cpu, [data = std::move(chunk), level = level] {
+            return compress(data, level);
+        }));
+        chunk.clear();
+        chunk.reserve(frameSize);
+        // twice as many frames as threads, the cpu lane stays busy while the oldest one is written
+        while (pending.size() > size_t(2 * threads)) writeNext();
+    }
+
+protected:
+    int overflow(int c) override {
+        if (c == traits_type::eof()) return c;
+        chunk.push_back(char(c));
+        if (chunk.size() >= frameSize) submit();
+        return c;
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        for (std::streamsize done = 0; done < n;) {
+            size_t count = std::min(size_t(n - done), frameSize - chunk.size());
+            chunk.append(s + done, count);
+            done += std::streamsize(count);
+            if (chunk.size() >= frameSize) submit();
+        }
+        return n;
+    }
+
+public:
+    ParallelZstdWriter(std::ostream& out, int level, int threads)
+        : out(out), level(level), threads(std::max(1, threads)) {
+        chunk.reserve(frameSize);
+    }
+
+    // writes the frames that are still compressing, returns the compressed size
+    uint64_t finish() {
+        submit();
+        while (!pending.empty()) writeNext();
+        out.flush();
+        return written;
+    }
+};
+
+// What a bundle holds besides the files: the spec of the vendor.txt it was exported for, dep-pull.lock and the
+// manifests of .dep-pull/manifests (file name and contents). It is the first member of the archive, bundleMember.
+struct BundleInfo {
+    static constexpr const char* header = "dep-pull bundle 1";
+    static constexpr const char* bundleMember = ".dep-pull/bundle";
+
+    std::string spec;
+    std::string lock;
+    std::vector<std::pair<std::string, std::string>> manifests;
+
+    std::string encode() const {
+        std::string s = std::string(header) + "\nspec " + spec + "\nlock " + std::to_string(lock.size()) + "\n" + lock;
+        for (auto& [name, contents] : manifests)
+            s += "manifest " + name + " " + std::to_string(contents.size()) + "\n" + contents;
+        return s;
+    }
+
+    static BundleInfo decode(const std::string& s) {
+        BundleInfo info;
+        std::istringstream in(s);
+        std::string line, field;
+        if (!std::getline(in, line) || line != header) throw std::runtime_error("not a dep-pull bundle");
+        auto contents = [&](size_t size) {
+            std::string data(size, '\0');
+            in.read(data.data(), std::streamsize(size));
+            return data;
+        };
+        while (in >> field) {
+            size_t size;
+            if (field == "spec") {
+                in >> info.spec;
+            } else if (field == "lock") {
+                in >> size;
+                in.get();
+                info.lock = contents(size);
+            } else if (field == "manifest") {
+                std::string name;
+                in >> name >> size;
+                in.get();
+                info.manifests.push_back({name, contents(size)});
+            } else {
+                throw std::runtime_error("invalid dep-pull bundle");
+            }
+            if (!in) throw std::runtime_error("truncated dep-pull bundle");
+        }
+        return info;
+    }
+};
+
+namespace {
+    inline std::string readWhole(std::filesystem::path file) {
+        std::ifstream in(file, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    inline bool sameContents(const std::filesystem::path& a, const std::filesystem::path& b) {
+        std::ifstream x(a, std::ios::binary), y(b, std::ios::binary);
+        std::vector<char> bx(1 << 16), by(1 << 16);
+        while (x && y) {
+            x.read(bx.data(), std::streamsize(bx.size()));
+            y.read(by.data(), std::streamsize(by.size()));
+            if (x.gcount() != y.gcount() || std::memcmp(bx.data(), by.data(), size_t(x.gcount())) != 0) return false;
+        }
+        return !x && !y;
+    }
+
+    // value of an octal field of a tar header
+    inline uint64_t tarOctal(const char* field, size_t length) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < length && field[i] >= '0' && field[i] <= '7'; i++)
+            value = value * 8 + uint64_t(field[i] - '0');
+        return value;
+    }
+} // namespace
+
+// Writes the files the manifests of the project list, with info, into file as a zstd compressed tar. Files with the
+// same contents are stored once, the others become hard links to the first one. The manifests must describe the files
+// as they are (see checkInstalled).
+inline void exportBundle(
+    const std::string& file, Path projectRoot, BundleInfo info, const std::map<std::string, Manifest>& manifests,
+    int threads
+) {
+    auto start = std::chrono::steady_clock::now();
+    std::filesystem::path root = projectDirectory(projectRoot);
+    std::filesystem::path dir = root / ".dep-pull" / "manifests";
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(dir, ec))
+        info.manifests.push_back({entry.path().filename().string(), readWhole(entry.path())});
+
+    std::vector<const ManifestEntry*> entries;
+    for (auto& [repo, manifest] : manifests)
+        for (auto& e : manifest.entries) entries.push_back(&e);
+    std::sort(entries.begin(), entries.end(), [](auto* a, auto* b) { return a->path < b->path; });
+
+    std::string tmp = file + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("failed to create " + tmp);
+    ParallelZstdWriter zstd(out, ZSTD_CLEVEL_DEFAULT, threads);
+    std::ostream tarStream(&zstd);
+    tar::Writer tar(tarStream);
+    tar.file(BundleInfo::bundleMember, info.encode(), 0644);
+
+    // by size and hash, the first path stored with those contents
+    std::map<std::pair<uint64_t, uint64_t>, std::vector<std::string>> stored;
+    uint64_t bytes = 0, files = 0, deduplicated = 0;
+    for (auto* e : entries) {
+        std::filesystem::path path = root / e->path;
+        struct stat st;
+        if (::lstat(path.c_str(), &st) != 0) throw std::runtime_error(e->path + " is missing, run dep-pull first");
+        files++;
+        if (S_ISLNK(st.st_mode)) {
+            tar.symlink(e->path, std::filesystem::read_symlink(path).string());
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        auto& same = stored[{e->size, e->hash}];
+        auto original = std::find_if(same.begin(), same.end(), [&](auto& p) { return sameContents(root / p, path); });
+        if (original != same.end()) {
+            tar.hardlink(e->path, *original, uint16_t(st.st_mode & 07777));
+            deduplicated++;
+            continue;
+        }
+        same.push_back(e->path);
+        std::ifstream data(path, std::ios::binary);
+        tar.file(e->path, data, uint64_t(st.st_size), uint16_t(st.st_mode & 07777));
+        bytes += uint64_t(st.st_size);
+    }
+    tar.finish();
+    uint64_t compressed = zstd.finish();
+    out.close();
+    if (!out) throw std::runtime_error("failed to write " + tmp);
+    std::filesystem::rename(tmp, file);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Exported " << files << " files (" << deduplicated << " deduplicated, " << formatSize(bytes)
+              << " stored) into " << file << " (" << formatSize(compressed) << ") in " << std::fixed
+              << std::setprecision(2) << seconds << "s" << std::defaultfloat << std::endl;
+}
+
+// the BundleInfo of file, only the first member is decompressed
+inline BundleInfo readBundleInfo(const std::string& file) {
+    ParallelDecompressStream in(file, 1);
+    char header[512];
+    if (!in.read(header, sizeof(header)) || std::string(header) != BundleInfo::bundleMember)
+        throw std::runtime_error(file + " is not a dep-pull bundle");
+    uint64_t size = tarOctal(header + 124, 12);
+    std::string contents(size, '\0');
+    if (!in.read(contents.data(), std::streamsize(size))) throw std::runtime_error(file + " is truncated");
+    return BundleInfo::decode(contents);
+}
+
+// Restores a bundle of exportBundle into the project: its files, .dep-pull/manifests and dep-pull.lock. It is
+// decompressed with decompressThreads and written by writerThreads. Fails before anything is written when the bundle
+// was exported for another vendor.txt than the one of spec, does not decompress completely or has members its
+// manifests do not list. Files the manifests of the project list that the bundle does not have are deleted like after
+// a run.
+inline void importBundle(
+    const std::string& file, Path projectRoot, const std::string& spec, const std::string& lockFile,
+    int decompressThreads, unsigned writerThreads
+) {
+    auto start = std::chrono::steady_clock::now();
+    std::filesystem::path root = projectDirectory(projectRoot);
+    std::filesystem::path state = root / ".dep-pull";
+    std::filesystem::path dir = state / "manifests";
+
+    BundleInfo info = readBundleInfo(file);
+    if (info.spec != spec)
+        throw std::runtime_error(file + " was exported for a different vendor.txt, run dep-pull instead");
+
+    // only the files of the manifests are extracted, each one inside of the project and none below another one (they
+    // are files and symlinks, a file below a symlink would be written wherever it points)
+    std::map<std::string, Manifest> bundled;
+    for (auto& [name, contents] : info.manifests) {
+        std::istringstream in(contents);
+        readManifest(in, bundled);
+    }
+    std::set<std::string> members = {BundleInfo::bundleMember};
+    size_t files = 0;
+    for (auto& [repo, manifest] : bundled) {
+        files += manifest.entries.size();
+        for (auto& e : manifest.entries) {
+            std::filesystem::path relative = std::filesystem::path(e.path).lexically_normal();
+            if (relative.empty() || relative.is_absolute() || *relative.begin() == "..")
+                throw std::runtime_error(file + " has a file outside of the project: " + e.path);
+            members.insert(relative.string());
+        }
+    }
+    for (auto& member : members) {
+        for (auto p = std::filesystem::path(member).parent_path(); !p.empty(); p = p.parent_path())
+            if (members.count(p.string())) throw std::runtime_error(file + " has a file below " + p.string());
+    }
+    auto listed = [&](const std::string& member) { return members.count(member) > 0; };
+
+    // A truncated or corrupt bundle must fail before the files it replaces are deleted, so it is read once without
+    // writing anything: the frames carry checksums, the tar has to end properly and have only the listed members.
+    {
+        TraceSpan span("verify", "bundle", file);
+        ParallelDecompressStream in(file, decompressThreads);
+        tar::Reader reader(in);
+        std::string unlisted;
+        reader.memberFilter = [&](const std::string& member) {
+            if (!listed(member) && unlisted.empty()) unlisted = member;
+            return false;
+        };
+        if (!reader.streamPath("./", root.string() + "/")) throw std::runtime_error(file + " is incomplete");
+        if (!unlisted.empty()) throw std::runtime_error(file + " has a member its manifests do not list: " + unlisted);
+    }
+
+    // the files are written anew, in place they could be hard links into the cache (--install-mode hardlink), and
+    // files of earlier runs where the bundle has directories go (a symlink there would lead the files elsewhere)
+    auto previous = loadManifests(dir);
+    std::set<std::string> earlier, installed;
+    for (auto& [repo, manifest] : previous)
+        for (auto& e : manifest.entries) earlier.insert(std::filesystem::path(e.path).lexically_normal().string());
+    for (auto& member : members) {
+        std::error_code ec;
+        for (auto p = std::filesystem::path(member).parent_path(); !p.empty(); p = p.parent_path())
+            if (earlier.count(p.string())) std::filesystem::remove(root / p, ec);
+        if (member == BundleInfo::bundleMember) continue;
+        std::filesystem::path path = root / member;
+        installed.insert(path.string());
+        if (!std::filesystem::is_directory(std::filesystem::symlink_status(path, ec)))
+            std::filesystem::remove(path, ec);
+    }
+
+    ParallelDecompressStream in(file, decompressThreads);
+    tar::Reader reader(in);
+    reader.writerThreads = writerThreads;
+    reader.extractHardLinksAsCopies = true; // deduplicated in the bundle, separate files in the project
+    reader.minPermissions = 0;
+    reader.memberFilter = listed;
+    if (!reader.streamPath("./", root.string() + "/")) throw std::runtime_error(file + " is incomplete");
+    traceWritten(reader);
+    std::filesystem::remove(root / BundleInfo::bundleMember);
+
+    // the manifests are newer than every file they list, so the next run does not read the files again
+    std::filesystem::create_directories(dir);
+    if (!std::filesystem::exists(state / ".gitignore")) std::ofstream(state / ".gitignore") << "*";
+    std::set<std::string> names;
+    for (auto& [name, contents] : info.manifests) {
+        std::ofstream(dir / (name + ".tmp"), std::ios::binary) << contents;
+        std::filesystem::rename(dir / (name + ".tmp"), dir / name);
+        names.insert(name);
+    }
+    for (auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (!names.count(entry.path().filename().string())) std::filesystem::remove(entry.path());
+    }
+    removeStale(previous, root, [&](const std::filesystem::path& f) { return installed.count(f.string()) > 0; });
+    {
+        std::ofstream(lockFile + ".tmp", std::ios::binary) << info.lock;
+        std::filesystem::rename(lockFile + ".tmp", lockFile);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Imported " << files << " files (" << formatSize(reader.bytesWritten) << " written) from " << file
+              << " in " << std::fixed << std::setprecision(2) << seconds << "s" << std::defaultfloat << std::endl;
+}
@@ -1,11 +1,16 @@
 #pragma once
 
+#include "conflict-index.hpp"
+#include "file-installer.hpp"
+#include "path-filter.hpp"
+#include "trace.hpp"
 #include <estd/filesystem.hpp>
 #include <estd/ptr.hpp>
+#include <estd/string_util.h>
 #include <filesystem>
 #include <iostream>
-#include <map>
 #include <memory>
+#include <set>
 #include <tar/tar.hpp>
 #include <thread>
 #include <vector>
@@ -17,10 +22,12 @@ using estd::files::RecursiveDirectoryIterator;
 
 namespace fs = estd::files;
 
-namespace {
-    std::map<Path, string> fileMap;
+// owner of everything installed by this run, first declared wins
+ConflictIndex conflictIndex;
 
-    std::vector<std::pair<Path, Path>> getListOfTransfered(Path from, Path to) {
+namespace {
+    // the paths below from that filter rejects are left out
+    std::vector<std::pair<Path, Path>> getListOfTransfered(Path from, Path to, const PathFilter& filter) {
         std::vector<std::pair<Path, Path>> result;
         if (fs::exists(from)) {
             Path f = from.normalize();
@@ -28,8 +35,16 @@ namespace {
             result.push_back({f, t});
 
             if (fs::isDirectory(from)) {
+                std::string root = f.addEmptySuffix().string();
                 for (const auto& entry : RecursiveDirectoryIterator(from)) {
                     Path f = entry.path().normalize();
+                    std::string path = f.removeEmptySuffix().string();
+                    if (!filter.empty()) {
+                        // the directories are made for the files in them, so none of them stays empty
+                        bool directory = entry.is_directory() && !entry.is_symlink();
+                        if (directory || path.rfind(root, 0) != 0 || !filter.selected(path.substr(root.size())))
+                            continue;
+                    }
                     Path t = *f.replacePrefix(from, to);
                     result.push_back({f, t.normalize()});
                 }
@@ -39,26 +54,52 @@ namespace {
     }
 } // namespace
 
-void copyRepo(std::string repo, Path source, Path destination) {
+// The first-wins check and the directories run in declaration order on the calling thread, only the file contents
+// are installed in parallel (with jobs threads). Only the paths below source that filter selects are installed.
+void copyRepo(
+    std::string repo, Path source, Path destination, InstallMode mode = InstallMode::copy, int jobs = 1,
+    const PathFilter& filter = {}
+) {
+    // installing nothing would make the files of the last run look stale to updateManifests
+    if (!fs::exists(source)) throw std::runtime_error(source.string() + " does not exist in (" + repo + ")");
+    TraceSpan span("copy", "install", repo);
+
+    std::set<std::string> directories;
+    auto createDirectory = [&](Path dir) {
+        if (directories.insert(dir.normalize().removeEmptySuffix().string()).second) fs::createDirectories(dir);
+    };
+
     if (fs::isDirectory(source)) {
-        fs::createDirectories(destination);
+        createDirectory(destination);
     } else {
-        fs::createDirectories(destination.splitSuffix().first);
+        createDirectory(destination.splitSuffix().first);
     }
 
-    for (auto e : getListOfTransfered(source, destination)) {
+    ConflictIndex::RepoId repoId = conflictIndex.repo(repo);
+    std::vector<std::pair<Path, Path>> files;
+    for (auto e : getListOfTransfered(source, destination, filter)) {
         Path from = e.first;
         Path to = e.second;
+        bool directory = !fs::isSoftLink(from.removeEmptySuffix()) && fs::isDirectory(from);
 
-        if (fileMap.count(to)) {
-            if (fileMap[to] != repo && !fs::isDirectory(from))
-                cout << "[WARNING] conflicting file " << to << " in (" << repo << ") using file from (" << fileMap[to]
-                     << ") since it was installed first\n";
+        ConflictIndex::RepoId owner = conflictIndex.claim(to, repoId, directory);
+        if (owner != ConflictIndex::noRepo) {
+            if (owner != repoId && !fs::isDirectory(from))
+                cout << "[WARNING] conflicting file " << to << " in (" << repo << ") using file from ("
+                     << conflictIndex.repoName(owner) << ") since it was installed first\n";
             continue;
         }
-        // cout << "fs::copy(" << from << ", " << to << ")\n";
-        fs::createDirectories(to.removeEmptySuffix().splitSuffix().first.normalize());
-        fs::copy(from, to, fs::CopyOptions::overwriteExisting | fs::CopyOptions::overwriteReadonly);
-        fileMap[to] = repo;
+
+        if (directory) {
+            fs::copy(from, to, fs::CopyOptions::overwriteExisting | fs::CopyOptions::overwriteReadonly);
+            directories.insert(to.normalize().removeEmptySuffix().string());
+            continue;
+        }
+        createDirectory(to.removeEmptySuffix().splitSuffix().first.normalize());
+        files.push_back({from, to});
     }
-}
\ No newline at end of file
+
+    tracer.count("files installed", int64_t(files.size()));
+    auto errors = installFiles(files, mode, jobs);
+    if (!errors.empty()) throw std::runtime_error(estd::string_util::joinAll(errors, "\n"));
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <estd/filesystem.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using estd::files::Path;
+
+// Owner of every path installed during a run. Paths are stored as a trie of interned components, a node is 16 bytes
+// and the children of all nodes live in a single hash table keyed by (parent, component), so millions of paths that
+// share their directories cost little more than their file names. Repos are referred to by small integer ids.
+class ConflictIndex {
+public:
+    using RepoId = uint32_t;
+    static const RepoId noRepo = 0;
+
+private:
+    static const uint32_t noNode = UINT32_MAX;
+
+    struct Node {
+        uint32_t parent;
+        uint32_t name;
+        RepoId owner;
+        bool directory;
+    };
+
+    std::vector<Node> nodes{{noNode, 0, noRepo, true}}; // node 0 is the root
+    std::unordered_map<std::string, uint32_t> names;
+    std::vector<const std::string*> nameList;
+    std::unordered_map<uint64_t, uint32_t> children;
+    std::unordered_map<std::string, RepoId> repoIds;
+    std::vector<std::string> repoNames{""};
+    std::vector<bool> shadowedRepos{false};
+
+    uint32_t intern(const std::string& component) {
+        auto it = names.emplace(component, uint32_t(nameList.size())).first;
+        if (it->second == nameList.size()) nameList.push_back(&it->first);
+        return it->second;
+    }
+
+    static uint64_t childKey(uint32_t parent, uint32_t name) { return (uint64_t(parent) << 32) | name; }
+
+    // walks (and with create, builds) the trie along path, noNode if it is not in the index
+    uint32_t find(Path path, bool create) {
+        uint32_t node = 0;
+        for (auto& component : components(path)) {
+            uint32_t name;
+            if (create) {
+                name = intern(component);
+            } else {
+                auto it = names.find(component);
+                if (it == names.end()) return noNode;
+                name = it->second;
+            }
+            auto it = children.find(childKey(node, name));
+            if (it != children.end()) {
+                node = it->second;
+            } else if (create) {
+                nodes.push_back({node, name, noRepo, true});
+                node = children[childKey(node, name)] = uint32_t(nodes.size() - 1);
+            } else {
+                return noNode;
+            }
+        }
+        return node;
+    }
+
+    static std::vector<std::string> components(Path path) {
+        std::vector<std::string> result;
+        std::string s = path.string();
+        size_t begin = 0;
+        while (begin <= s.size()) {
+            size_t end = s.find('/', begin);
+            if (end == std::string::npos) end = s.size();
+            std::string c = s.substr(begin, end - begin);
+            if (c == "..") {
+                if (!result.empty()) result.pop_back();
+            } else if (c != "" && c != ".") {
+                result.push_back(c);
+            }
+            begin = end + 1;
+        }
+        return result;
+    }
+
+public:
+    RepoId repo(const std::string& name) {
+        auto it = repoIds.emplace(name, RepoId(repoNames.size())).first;
+        if (it->second == repoNames.size()) {
+            repoNames.push_back(name);
+            shadowedRepos.push_back(false);
+        }
+        return it->second;
+    }
+
+    const std::string& repoName(RepoId id) const { return repoNames[id]; }
+
+    // whether a file of repo was not installed because an earlier repo claimed the same path
+    bool shadowed(const std::string& name) const {
+        auto it = repoIds.find(name);
+        return it != repoIds.end() && shadowedRepos[it->second];
+    }
+
+    // owner of path, noRepo if nothing was installed there
+    RepoId owner(Path path) {
+        uint32_t node = find(path, false);
+        return node == noNode ? noRepo : nodes[node].owner;
+    }
+
+    // Takes path for repo unless it belongs to a repo already, returns the previous owner (noRepo if the claim
+    // succeeded). Paths are absolute, "a/b" and "a/b/" are the same entry.
+    RepoId claim(Path path, RepoId repo, bool directory) {
+        Node& node = nodes[find(path, true)];
+        if (node.owner != noRepo) {
+            if (node.owner != repo && !directory) shadowedRepos[repo] = true;
+            return node.owner;
+        }
+        node.owner = repo;
+        node.directory = directory;
+        return noRepo;
+    }
+
+    Path path(uint32_t node) const {
+        std::vector<uint32_t> chain;
+        for (; node != 0; node = nodes[node].parent) chain.push_back(node);
+        std::string result;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) result += "/" + *nameList[nodes[*it].name];
+        return result.empty() ? "/" : result;
+    }
+
+    // calls f(path, owner) for every claimed file (everything but directories)
+    template <typename F>
+    void forEachFile(F f) const {
+        for (uint32_t i = 1; i < nodes.size(); i++) {
+            if (nodes[i].owner != noRepo && !nodes[i].directory) f(path(i), nodes[i].owner);
+        }
+    }
+
+    size_t size() const { return nodes.size() - 1; }
+};
@@ -0,0 +1,419 @@
+#pragma once
+
+#include "hash.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// A run of dep-pull sent to the daemon: the project directory and the arguments.
+struct DaemonRequest {
+    std::string directory;
+    std::vector<std::string> args;
+
+    // requests with the same key install the same thing into the same project, they are one run, spec is the hash of
+    // vendor.txt and the files it includes as the daemon reads them
+    std::string key(const std::string& spec) const {
+        Sha256 h;
+        h.update(directory + '\0');
+        for (auto& a : args) h.update(a + '\0');
+        return h.update(spec).hexDigest();
+    }
+};
+
+namespace {
+    inline bool sendAll(int fd, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            length -= size_t(n);
+        }
+        return true;
+    }
+
+    inline sockaddr_un socketAddress(const std::string& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error("socket path too long: " + path);
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+    // -1 if nothing listens on path
+    inline int connectSocket(const std::string& path) {
+        sockaddr_un address = socketAddress(path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // "dep-pull 2", "directory <dir>", an "arg <arg>" line per argument and "end"
+    inline std::string encodeRequest(const DaemonRequest& request) {
+        std::string message = "dep-pull 2\ndirectory " + request.directory + "\n";
+        for (auto& a : request.args) message += "arg " + a + "\n";
+        return message + "end\n";
+    }
+
+    // a request is complete once it ends with the "end" line, the client sends nothing after it
+    inline bool requestComplete(const std::string& message) {
+        return message.size() >= 5 && message.compare(message.size() - 5, 5, "\nend\n") == 0;
+    }
+
+    // false if message is not a complete request
+    inline bool parseRequest(const std::string& message, DaemonRequest& request) {
+        std::istringstream in(message);
+        std::string l;
+        if (!std::getline(in, l) || l != "dep-pull 2") return false;
+        while (std::getline(in, l)) {
+            size_t space = l.find(' ');
+            std::string field = l.substr(0, space);
+            std::string value = space == std::string::npos ? "" : l.substr(space + 1);
+            if (field == "end") {
+                return true;
+            } else if (field == "directory") {
+                request.directory = value;
+            } else if (field == "arg") {
+                request.args.push_back(value);
+            } else {
+                return false;
+            }
+        }
+        return false;
+    }
+} // namespace
+
+// $DEP_PULL_SOCKET, then $XDG_RUNTIME_DIR/dep-pull.sock, then /tmp/dep-pull-<uid>.sock
+inline std::string defaultSocketPath() {
+    if (const char* s = std::getenv("DEP_PULL_SOCKET"); s && *s) return s;
+    if (const char* dir = std::getenv("XDG_RUNTIME_DIR"); dir && *dir) return std::string(dir) + "/dep-pull.sock";
+    return "/tmp/dep-pull-" + std::to_string(getuid()) + ".sock";
+}
+
+// Sends request to the daemon listening on socketPath and copies the output of the run to out as it arrives.
+// Returns false if no daemon is listening there.
+inline bool runOnDaemon(const std::string& socketPath, const DaemonRequest& request, std::ostream& out) {
+    int fd = connectSocket(socketPath);
+    if (fd < 0) return false;
+    std::string message = encodeRequest(request);
+    if (!sendAll(fd, message.data(), message.size())) {
+        close(fd);
+        return false;
+    }
+    char chunk[65536];
+    ssize_t n;
+    while ((n = recv(fd, chunk, sizeof(chunk), 0)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            out << "[WARNING] lost the connection to the daemon: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        out.write(chunk, n);
+        out.flush();
+    }
+    close(fd);
+    return true;
+}
+
+// The server side of dep-pull --daemon. Clients connect to a Unix socket and send a DaemonRequest, run(request) is
+// called for it with std::cout going to the client, so the client sees the output of the run as it is written.
+//
+// Runs happen one after another, each one in the project it is for, and everything they set up (the HTTP
+// connections, the deb indexes, the cache) stays for the next one. A request that has the same key as one that is
+// queued or running joins it: it gets the output so far and then the rest, the run happens once for both.
+class Daemon {
+private:
+    struct Job {
+        DaemonRequest request;
+        std::string key;
+        std::vector<int> clients;
+        std::string output;
+    };
+
+    // std::cout during a run, every byte goes to the clients of the job and is kept for clients that join later
+    class Broadcast : public std::streambuf {
+    private:
+        Daemon& daemon;
+
+    protected:
+        int overflow(int c) override {
+            if (c != traits_type::eof()) {
+                char ch = char(c);
+                daemon.broadcast(&ch, 1);
+            }
+            return c;
+        }
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            daemon.broadcast(s, size_t(n));
+            return n;
+        }
+
+    public:
+        Broadcast(Daemon& daemon) : daemon(daemon) {}
+    };
+
+    // the request of a client that connected, read on the accept loop between other clients
+    struct Pending {
+        int fd;
+        std::string message;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // a client that does not read (or finish its request) for this long is dropped, so it can not hold up the others
+    static constexpr int clientTimeout = 10;
+    static constexpr size_t maxRequestSize = 1 << 20;
+
+    std::string socketPath;
+    std::function<void(const DaemonRequest&)> run;
+    std::function<std::string(const std::string&)> spec;
+    std::mutex lock;       // queue, running and stopping
+    std::mutex outputLock; // the output and the clients of the running job, taken before lock
+    std::condition_variable queued;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::shared_ptr<Job> running;
+    bool stopping = false;
+    std::thread runner;
+    int listener = -1;
+    std::vector<Pending> pending;
+
+    // written to by the SIGINT and SIGTERM handler, serve() returns when it becomes readable
+    static inline int stopPipe[2] = {-1, -1};
+    static void onSignal(int) {
+        char c = 0;
+        (void)!write(stopPipe[1], &c, 1);
+    }
+
+    // only holds outputLock while it sends, so a slow client delays the output of the run (until clientTimeout) but
+    // never the requests of other projects
+    void broadcast(const char* data, size_t length) {
+        std::lock_guard<std::mutex> o(outputLock);
+        std::shared_ptr<Job> job;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            job = running;
+        }
+        if (!job) return;
+        job->output.append(data, length);
+        auto& clients = job->clients;
+        for (size_t i = 0; i < clients.size();) {
+            if (sendAll(clients[i], data, length)) {
+                i++;
+            } else {
+                close(clients[i]); // the client went away, the run goes on for the others
+                clients.erase(clients.begin() + long(i));
+            }
+        }
+    }
+
+    // reads what the client sent without waiting for more, false once the client is done (accepted or dropped)
+    bool receive(Pending& client) {
+        char chunk[4096];
+        ssize_t n = recv(client.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n > 0) client.message.append(chunk, size_t(n));
+        if (n > 0 && client.message.size() <= maxRequestSize && !requestComplete(client.message)) return true;
+        DaemonRequest request;
+        if (n > 0 && client.message.size() <= maxRequestSize && parseRequest(client.message, request) &&
+            !request.directory.empty() && request.directory[0] == '/') {
+            accept(client.fd, std::move(request));
+        } else {
+            close(client.fd);
+        }
+        return false;
+    }
+
+    void accept(int fd, DaemonRequest request) {
+        std::string key = request.key(spec(request.directory));
+        std::unique_lock<std::mutex> o(outputLock, std::defer_lock);
+        std::unique_lock<std::mutex> l(lock);
+        if (running && running->key == key) {
+            // joining needs the output so far and then every later byte, nothing may be broadcast in between
+            l.unlock();
+            o.lock();
+            l.lock();
+        }
+        if (running && running->key == key) {
+            // the job can not finish while outputLock is held, the queue is free for others in the meantime
+            auto job = running;
+            l.unlock();
+            if (sendAll(fd, job->output.data(), job->output.size())) {
+                job->clients.push_back(fd);
+            } else {
+                close(fd);
+            }
+            return;
+        }
+        for (auto& job : queue) {
+            if (job->key == key) {
+                job->clients.push_back(fd);
+                return;
+            }
+        }
+        queue.push_back(std::make_shared<Job>(Job{std::move(request), key, {fd}, ""}));
+        queued.notify_one();
+    }
+
+    void runJobs() {
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                queued.wait(l, [&] { return !queue.empty() || stopping; });
+                if (stopping) return;
+                job = queue.front();
+                queue.pop_front();
+                running = job;
+            }
+            auto start = std::chrono::steady_clock::now();
+            Broadcast out(*this);
+            std::streambuf* previous = std::cout.rdbuf(&out);
+            try {
+                run(job->request);
+            } catch (std::exception& e) { std::cout << "[ERROR] " << e.what() << std::endl; }
+            std::cout.flush();
+            std::cout.rdbuf(previous);
+
+            size_t clients;
+            {
+                std::lock_guard<std::mutex> o(outputLock);
+                std::lock_guard<std::mutex> l(lock);
+                clients = job->clients.size();
+                for (int fd : job->clients) close(fd);
+                running = nullptr;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Ran " << job->request.directory << " for " << clients << " client(s) in " << std::fixed
+                      << std::setprecision(2) << seconds << "s" << std::defaultfloat << std::endl;
+        }
+    }
+
+public:
+    // spec(directory) hashes vendor.txt and its includes in directory, it is called on the accept loop while a run
+    // may be going on in another directory
+    Daemon(
+        std::string socketPath, std::function<void(const DaemonRequest&)> run,
+        std::function<std::string(const std::string&)> spec
+    )
+        : socketPath(std::move(socketPath)), run(std::move(run)), spec(std::move(spec)) {}
+    Daemon(const Daemon&) = delete;
+    Daemon& operator=(const Daemon&) = delete;
+
+    // lets the running job finish, the queued ones are dropped
+    ~Daemon() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+            for (auto& job : queue)
+                for (int fd : job->clients) close(fd);
+            queue.clear();
+        }
+        queued.notify_all();
+        if (runner.joinable()) runner.join();
+        for (auto& client : pending) close(client.fd);
+        if (listener < 0) return;
+        close(listener);
+        unlink(socketPath.c_str());
+    }
+
+    // listens until SIGINT or SIGTERM, throws if the socket can not be created or another daemon owns it
+    void serve() {
+        if (int fd = connectSocket(socketPath); fd >= 0) {
+            close(fd);
+            throw std::runtime_error("a daemon is already listening on " + socketPath);
+        }
+        unlink(socketPath.c_str()); // left behind by a daemon that was killed
+
+        sockaddr_un address = socketAddress(socketPath);
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0) throw std::runtime_error(std::string("failed to create a socket: ") + std::strerror(errno));
+        // the daemon writes into any project it is asked to, only its own user may ask: the socket is created 0600
+        // (a chmod after bind would leave a window) and accept checks the uid of every client
+        mode_t previousMask = umask(077);
+        int bound = bind(listener, (sockaddr*)&address, sizeof(address));
+        umask(previousMask);
+        if (bound != 0 || listen(listener, 64) != 0) {
+            throw std::runtime_error("failed to listen on " + socketPath + ": " + std::strerror(errno));
+        }
+        std::cout << "Listening on " << socketPath << std::endl;
+
+        if (stopPipe[0] < 0 && pipe2(stopPipe, O_CLOEXEC) != 0)
+            throw std::runtime_error(std::string("failed to create a pipe: ") + std::strerror(errno));
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+
+        runner = std::thread([this] { runJobs(); });
+        // requests are read as they arrive from all clients at once, a client gets clientTimeout for all of it
+        while (true) {
+            std::vector<pollfd> fds = {{listener, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+            for (auto& client : pending) fds.push_back({client.fd, POLLIN, 0});
+            int timeout = -1;
+            auto now = std::chrono::steady_clock::now();
+            for (auto& client : pending) {
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(client.deadline - now).count();
+                timeout = std::max(0, timeout < 0 ? int(left) : std::min(timeout, int(left)));
+            }
+            if (poll(fds.data(), fds.size(), timeout) < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("poll failed: ") + std::strerror(errno));
+            }
+            if (fds[1].revents) {
+                std::cout << "Stopping" << std::endl;
+                return;
+            }
+
+            now = std::chrono::steady_clock::now();
+            std::vector<Pending> waiting;
+            for (size_t i = 0; i < pending.size(); i++) {
+                if (fds[i + 2].revents && !receive(pending[i])) continue;
+                if (now >= pending[i].deadline) {
+                    close(pending[i].fd);
+                    continue;
+                }
+                waiting.push_back(std::move(pending[i]));
+            }
+            pending = std::move(waiting);
+
+            if (!fds[0].revents) continue;
+            int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                throw std::runtime_error(std::string("accept failed: ") + std::strerror(errno));
+            }
+            ucred peer{};
+            socklen_t peerSize = sizeof(peer);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerSize) != 0 || peer.uid != getuid()) {
+                close(fd);
+                continue;
+            }
+            timeval sendTimeout{clientTimeout, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+            pending.push_back({fd, "", now + std::chrono::seconds(clientTimeout)});
+        }
+    }
+};
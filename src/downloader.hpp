@@ -0,0 +1,377 @@
+#pragma once
+
+#ifndef CPPHTTPLIB_OPENSSL_SUPPORT
+    #define CPPHTTPLIB_OPENSSL_SUPPORT
+#endif
+#include "trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <estd/filesystem.hpp>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <httplib.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using estd::files::Path;
+
+// write side of a download, collects the small pieces httplib delivers into large writes
+class FileSink {
+private:
+    static const size_t bufferSize = 4 << 20;
+    int fd;
+    std::string name;
+    std::vector<char> buffer;
+    size_t used = 0;
+    off_t offset;
+
+    void flush() {
+        for (size_t done = 0; done < used;) {
+            ssize_t n = pwrite(fd, buffer.data() + done, used - done, offset);
+            if (n < 0) throw std::runtime_error("failed to write " + name + ": " + std::strerror(errno));
+            done += n;
+            offset += n;
+        }
+        used = 0;
+    }
+
+public:
+    // writes at offset of an already open file, the caller closes fd
+    FileSink(int fd, std::string name, off_t offset = 0)
+        : fd(fd), name(name), buffer(bufferSize), offset(offset) {}
+
+    void write(const char* data, size_t length) {
+        while (length > 0) {
+            size_t n = std::min(length, buffer.size() - used);
+            std::memcpy(buffer.data() + used, data, n);
+            used += n;
+            data += n;
+            length -= n;
+            if (used == buffer.size()) flush();
+        }
+    }
+
+    void close() { flush(); }
+};
+
+struct FileDescriptorGuard {
+    int fd;
+    ~FileDescriptorGuard() {
+        if (fd >= 0) ::close(fd);
+    }
+};
+
+// The one HTTP client of dep-pull, shared by the tar fetch, the deb package lists and the .deb files.
+//
+// Connections are kept alive in a pool per host and reused by the next request to that host, from any thread, so a
+// batch of downloads pays the TCP and TLS handshakes once per parallel connection instead of once per file.
+// Interrupted transfers continue where they stopped with a Range request, failed requests (408, 429, 5xx, network
+// errors) are retried after retryDelay seconds, doubled every time, or as long as the server asks for in Retry-After.
+// Files of at least rangeThreshold bytes on servers that accept ranges are split into up to maxRanges parts
+// downloaded in parallel. At most maxConnections requests to the same host are open at once, the others wait for one
+// of them to finish.
+class Downloader {
+public:
+    struct HostStats {
+        uint64_t bytes = 0;
+        int requests = 0;
+        int connections = 0;
+        int retries = 0;
+        std::chrono::steady_clock::time_point first;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    uint64_t rangeThreshold = 16 << 20;
+    uint64_t rangeSize = 8 << 20;
+    int maxRanges = 8;
+    int maxConnections = 6;
+    int attempts = 3;
+    // seconds before the second attempt, doubled for every further one, unless the server sends Retry-After
+    double retryDelay = 1;
+    double maxRetryDelay = 60;
+
+private:
+    std::mutex lock;
+    std::condition_variable connectionFreed;
+    std::map<std::string, std::vector<std::unique_ptr<httplib::Client>>> idle;
+    std::map<std::string, int> busy;
+    std::map<std::string, HostStats> stats;
+
+    static std::pair<std::string, std::string> splitUrl(const std::string& url) {
+        size_t scheme = url.find("://");
+        size_t pathStart = url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+        if (pathStart == std::string::npos) return {url, "/"};
+        return {url.substr(0, pathStart), url.substr(pathStart)};
+    }
+
+    // every acquire is followed by a release, or by a discard when the connection failed
+    std::unique_ptr<httplib::Client> acquire(const std::string& host) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            connectionFreed.wait(l, [&] { return busy[host] < maxConnections; });
+            busy[host]++;
+            auto& pool = idle[host];
+            auto& s = stats[host];
+            s.requests++;
+            if (s.requests == 1) s.first = std::chrono::steady_clock::now();
+            if (!pool.empty()) {
+                auto client = std::move(pool.back());
+                pool.pop_back();
+                return client;
+            }
+            s.connections++;
+        }
+        auto client = std::make_unique<httplib::Client>(host);
+        client->set_keep_alive(true);
+        client->set_follow_location(true);
+        client->set_connection_timeout(10);
+        client->set_read_timeout(30);
+        client->set_write_timeout(30);
+        return client;
+    }
+
+    void release(const std::string& host, std::unique_ptr<httplib::Client> client) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stats[host].last = std::chrono::steady_clock::now();
+            idle[host].push_back(std::move(client));
+            busy[host]--;
+        }
+        connectionFreed.notify_all();
+    }
+
+    void discard(const std::string& host) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            busy[host]--;
+        }
+        connectionFreed.notify_all();
+    }
+
+    void count(const std::string& host, size_t bytes, bool retry) {
+        std::lock_guard<std::mutex> l(lock);
+        auto& s = stats[host];
+        s.bytes += bytes;
+        s.last = std::chrono::steady_clock::now();
+        if (retry) s.retries++;
+    }
+
+    static bool retryable(int status) { return status == 408 || status == 429 || status >= 500; }
+
+    // seconds the server asked to wait in a Retry-After header (a number or an HTTP date), -1 if it did not
+    static double retryAfter(const httplib::Response& response) {
+        std::string value = response.get_header_value("Retry-After");
+        if (value.empty()) return -1;
+        if (std::all_of(value.begin(), value.end(), [](char c) { return c >= '0' && c <= '9'; }))
+            return std::stod(value);
+        std::tm date{};
+        std::istringstream in(value);
+        in >> std::get_time(&date, "%a, %d %b %Y %H:%M:%S");
+        if (in.fail()) return -1;
+        return std::max(0.0, std::difftime(timegm(&date), std::time(nullptr)));
+    }
+
+    // GET of the bytes [begin, end] (end == UINT64_MAX: to the end of the file, begin == 0 and no end: a plain
+    // request) with resume. receiver sees every byte of the range once and in order.
+    int fetch(
+        const std::string& url,
+        const httplib::Headers& headers,
+        httplib::Headers* responseHeaders,
+        std::function<void(const char*, size_t)> receiver,
+        uint64_t begin = 0,
+        uint64_t end = UINT64_MAX
+    ) {
+        auto [host, path] = splitUrl(url);
+        bool ranged = begin > 0 || end != UINT64_MAX;
+        uint64_t received = 0;
+        std::string lastError;
+
+        double wait = -1; // before the next attempt, -1 for the backoff
+        for (int attempt = 1; attempt <= attempts; attempt++) {
+            if (attempt > 1) {
+                double backoff = wait >= 0 ? wait : retryDelay * double(1 << std::min(attempt - 2, 16));
+                std::this_thread::sleep_for(std::chrono::duration<double>(std::min(backoff, maxRetryDelay)));
+                wait = -1;
+            }
+            httplib::Headers h = headers;
+            if (ranged || received > 0) {
+                h.emplace(
+                    "Range",
+                    "bytes=" + std::to_string(begin + received) + "-" + (end == UINT64_MAX ? "" : std::to_string(end))
+                );
+            }
+            int status = 0;
+            uint64_t skip = 0;
+            size_t delivered = 0;
+            std::exception_ptr receiverError;
+            auto client = acquire(host);
+            auto res = client->Get(
+                path,
+                h,
+                [&](const httplib::Response& response) {
+                    status = response.status;
+                    // a server without range support sends everything again, drop what we have
+                    if (status == 200) {
+                        if (ranged) return false;
+                        skip = received;
+                    }
+                    return true;
+                },
+                [&](const char* data, size_t length) {
+                    if (status < 200 || status >= 300) return true; // error pages are not content
+                    size_t n = size_t(std::min<uint64_t>(skip, length));
+                    skip -= n;
+                    if (length > n) {
+                        tracer.count("bytes downloaded", int64_t(length - n));
+                        try {
+                            receiver(data + n, length - n);
+                        } catch (...) {
+                            receiverError = std::current_exception();
+                            return false;
+                        }
+                        received += length - n;
+                        delivered += length - n;
+                    }
+                    return true;
+                }
+            );
+            count(host, delivered, attempt > 1);
+            if (delivered > 0) wait = 0; // an interrupted transfer that made progress resumes right away
+            if (receiverError) {
+                discard(host);
+                std::rethrow_exception(receiverError);
+            }
+
+            if (res.error() == httplib::Error::Success) {
+                release(host, std::move(client));
+                if (responseHeaders) *responseHeaders = res->headers;
+                if (status == 304 || (status >= 200 && status < 300)) return status;
+                lastError = "HTTP status " + std::to_string(status);
+                if (!retryable(status)) break;
+                wait = retryAfter(*res);
+            } else if (status == 200 && ranged) {
+                discard(host);
+                lastError = "the server does not support ranges";
+                break;
+            } else {
+                discard(host);
+                lastError = httplib::to_string(res.error());
+            }
+        }
+        throw std::runtime_error("download of " + url + " failed: " + lastError);
+    }
+
+    // size of url if the server accepts ranges for it, 0 otherwise
+    uint64_t rangeableSize(const std::string& url) {
+        auto [host, path] = splitUrl(url);
+        auto client = acquire(host);
+        auto res = client->Head(path);
+        if (res.error() != httplib::Error::Success) {
+            discard(host);
+            return 0;
+        }
+        release(host, std::move(client));
+        if (res->status != 200 || res->get_header_value("Accept-Ranges") != "bytes") return 0;
+        std::string length = res->get_header_value("Content-Length");
+        return length.empty() ? 0 : std::stoull(length);
+    }
+
+    void downloadRanges(const std::string& url, int fd, const std::string& name, uint64_t size) {
+        if (ftruncate(fd, off_t(size)) != 0) throw std::runtime_error("failed to resize " + name);
+        uint64_t parts = std::min<uint64_t>(maxRanges, (size + rangeSize - 1) / rangeSize);
+        uint64_t partSize = (size + parts - 1) / parts;
+
+        std::vector<std::thread> threads;
+        std::vector<std::string> errors(parts);
+        for (uint64_t i = 0; i < parts; i++) {
+            threads.emplace_back([&, i] {
+                uint64_t begin = i * partSize;
+                uint64_t end = std::min(size, begin + partSize) - 1;
+                try {
+                    FileSink sink(fd, name, off_t(begin));
+                    fetch(url, {}, nullptr, [&](const char* data, size_t length) { sink.write(data, length); }, begin, end);
+                    sink.close();
+                } catch (std::exception& e) { errors[i] = e.what(); }
+            });
+        }
+        for (auto& t : threads) t.join();
+        for (auto& e : errors)
+            if (!e.empty()) throw std::runtime_error(e);
+    }
+
+public:
+    // "scheme://host[:port]" of url, the key its connections are pooled and limited by
+    static std::string hostOf(const std::string& url) { return splitUrl(url).first; }
+
+    // Streams the body of url into receiver and returns the status: 2xx, or 304 when headers make the request
+    // conditional. Throws on any other status and when the transfer can not be completed.
+    int get(
+        const std::string& url,
+        std::function<void(const char*, size_t)> receiver,
+        const httplib::Headers& headers = {},
+        httplib::Headers* responseHeaders = nullptr
+    ) {
+        TraceSpan span("download", "network", url);
+        return fetch(url, headers, responseHeaders, receiver);
+    }
+
+    // Downloads url into file. size is a hint (from a package index for example), files known to be small skip
+    // the HEAD request that checks for range support.
+    void downloadFile(const std::string& url, Path file, uint64_t size = 0) {
+        TraceSpan span("download", "network", url);
+        std::filesystem::create_directories(std::filesystem::path(file.string()).parent_path());
+        std::string name = file.string();
+        FileDescriptorGuard fd{open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+        if (fd.fd < 0) throw std::runtime_error("failed to create " + name + ": " + std::strerror(errno));
+
+        if (size == 0 || size >= rangeThreshold) {
+            uint64_t length = rangeableSize(url);
+            if (length >= rangeThreshold) {
+                try {
+                    downloadRanges(url, fd.fd, name, length);
+                    return;
+                } catch (std::exception&) {
+                    if (ftruncate(fd.fd, 0) != 0) throw std::runtime_error("failed to truncate " + name);
+                }
+            }
+        }
+
+        FileSink sink(fd.fd, name);
+        get(url, [&](const char* data, size_t length) { sink.write(data, length); });
+        sink.close();
+    }
+
+    void clearStats() {
+        std::lock_guard<std::mutex> l(lock);
+        stats.clear();
+    }
+
+    // per host totals, the throughput is measured from the first request to the last byte
+    void printStats(std::ostream& out) {
+        std::lock_guard<std::mutex> l(lock);
+        for (auto& [host, s] : stats) {
+            if (s.bytes == 0) continue;
+            double seconds = std::chrono::duration<double>(s.last - s.first).count();
+            out << "Downloaded " << formatSize(s.bytes) << " from " << host << " in " << std::fixed
+                << std::setprecision(2) << seconds << "s (" << formatSize(uint64_t(s.bytes / std::max(seconds, 0.001)))
+                << "/s, " << s.requests << " requests on " << s.connections << " new connections";
+            if (s.retries) out << ", " << s.retries << " retried";
+            out << ")" << std::defaultfloat << std::endl;
+        }
+    }
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "scheduler.hpp"
+#include "trace.hpp"
+#include <cerrno>
+#include <cstring>
+#include <estd/filesystem.hpp>
+#include <fcntl.h>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#ifdef __linux__
+    #include <linux/fs.h>
+    #include <sys/ioctl.h>
+#endif
+
+using estd::files::Path;
+
+// How files get from the cache into the project. Every mode falls back to a plain copy when the filesystem does
+// not support it (different filesystems, no reflink support, ...).
+enum class InstallMode {
+    automatic, // reflink, then copy_file_range, then copy
+    reflink,   // copy on write clone (FICLONE), shares blocks with the cache until one side is modified
+    hardlink,  // same inode as the cache, editing a vendored file in place also edits the cache
+    copyRange, // in kernel copy (copy_file_range)
+    copy,      // read and write
+};
+
+inline InstallMode parseInstallMode(const std::string& mode) {
+    if (mode == "auto") return InstallMode::automatic;
+    if (mode == "reflink") return InstallMode::reflink;
+    if (mode == "hardlink") return InstallMode::hardlink;
+    if (mode == "copy-range") return InstallMode::copyRange;
+    if (mode == "copy") return InstallMode::copy;
+    throw std::runtime_error("--install-mode must be auto, reflink, hardlink, copy-range or copy");
+}
+
+namespace {
+    struct FileDescriptor {
+        int fd;
+        FileDescriptor(int fd) : fd(fd) {}
+        ~FileDescriptor() {
+            if (fd >= 0) close(fd);
+        }
+    };
+
+    inline void throwErrno(const std::string& what, Path p) {
+        throw std::runtime_error(what + " " + p.string() + ": " + std::strerror(errno));
+    }
+
+    inline bool reflinkFile(int in, int out) {
+#ifdef FICLONE
+        return ioctl(out, FICLONE, in) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // false if the kernel or the filesystem can not do it, the caller has to copy by hand then
+    inline bool copyFileRange(int in, int out, off_t size, Path from) {
+#ifdef __linux__
+        off_t done = 0;
+        while (done < size) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, size - done, 0);
+            if (n < 0) {
+                if (done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                    return false;
+                throwErrno("copy_file_range failed for", from);
+            }
+            if (n == 0) break;
+            done += n;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    inline void copyFileData(int in, int out, Path from) {
+        thread_local std::vector<char> buffer(1 << 20);
+        while (true) {
+            ssize_t n = read(in, buffer.data(), buffer.size());
+            if (n < 0) throwErrno("failed to read", from);
+            if (n == 0) return;
+            for (ssize_t written = 0; written < n;) {
+                ssize_t w = write(out, buffer.data() + written, n - written);
+                if (w < 0) throwErrno("failed to write copy of", from);
+                written += w;
+            }
+        }
+    }
+} // namespace
+
+// installs a single file or softlink, replacing whatever is at to (the parent directory has to exist)
+inline void installFile(Path from, Path to, InstallMode mode) {
+    std::string src = from.removeEmptySuffix().string();
+    std::string dst = to.removeEmptySuffix().string();
+    std::error_code ec;
+
+    if (std::filesystem::symlink_status(dst, ec).type() != std::filesystem::file_type::not_found) {
+        std::filesystem::remove_all(dst);
+    }
+
+    if (std::filesystem::is_symlink(src)) {
+        std::filesystem::copy_symlink(src, dst);
+        return;
+    }
+
+    if (mode == InstallMode::hardlink) {
+        std::filesystem::create_hard_link(src, dst, ec);
+        if (!ec) return;
+    }
+
+    FileDescriptor in(open(src.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd < 0) throwErrno("failed to open", from);
+    struct stat st;
+    if (fstat(in.fd, &st) != 0) throwErrno("failed to stat", from);
+    FileDescriptor out(open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777));
+    if (out.fd < 0) throwErrno("failed to create", to);
+
+    bool done = false;
+    if (mode == InstallMode::automatic || mode == InstallMode::reflink) done = reflinkFile(in.fd, out.fd);
+    if (!done && (mode == InstallMode::automatic || mode == InstallMode::copyRange))
+        done = copyFileRange(in.fd, out.fd, st.st_size, from);
+    if (!done) copyFileData(in.fd, out.fd, from);
+
+    fchmod(out.fd, st.st_mode & 07777); // the umask applies to open
+}
+
+// Installs many files at once in about 4 * jobs slices on the io lane of the scheduler. All parent directories must
+// exist already. Errors do not stop the other files, they are returned as messages.
+inline std::vector<std::string> installFiles(
+    const std::vector<std::pair<Path, Path>>& files, InstallMode mode, int jobs
+) {
+    std::vector<std::string> errors;
+    std::mutex errorLock;
+    auto installRange = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            try {
+                installFile(files[i].first, files[i].second, mode);
+            } catch (std::exception& e) {
+                std::lock_guard<std::mutex> l(errorLock);
+                errors.push_back(e.what());
+            }
+        }
+    };
+
+    // a thread per file is not worth it for a handful of files
+    if (jobs <= 1 || files.size() < 64) {
+        installRange(0, files.size());
+        return errors;
+    }
+
+    // a few slices per job on the io lane, the calling thread copies its share too
+    size_t slices = size_t(jobs) * 4;
+    size_t sliceSize = (files.size() + slices - 1) / slices;
+    TaskGroup group;
+    for (size_t begin = 0; begin < files.size(); begin += sliceSize) {
+        size_t end = std::min(files.size(), begin + sliceSize);
+        group.run(Lane::io, [=, &installRange] { installRange(begin, end); });
+    }
+    group.wait();
+    return errors;
+}
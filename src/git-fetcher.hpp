@@ -0,0 +1,209 @@
+#pragma once
+
+#include "artifact-store.hpp"
+#include "hash.hpp"
+#include "path-filter.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <estd/filesystem.hpp>
+#include <estd/string_util.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <subprocess/subprocess.hpp>
+#include <vector>
+
+using estd::files::Path;
+
+namespace {
+    struct CommandResult {
+        int retcode = 0;
+        std::string out;
+        std::string err;
+    };
+
+    inline CommandResult runCommand(std::vector<std::string> args, subprocess::env_map_t env = {}) {
+        TraceSpan span(args[0], "process", estd::string_util::joinAll(args, " "));
+        using namespace subprocess;
+        auto p = Popen(args, input{PIPE}, output{PIPE}, error{PIPE}, environment{env});
+        auto comm = p.communicate();
+        p.close_input();
+        CommandResult result;
+        result.retcode = p.retcode();
+        result.out = std::string(comm.first.buf.data(), std::max(0, int(comm.first.length)));
+        result.err = std::string(comm.second.buf.data(), std::max(0, int(comm.second.length)));
+        return result;
+    }
+
+    inline std::string runGit(std::vector<std::string> args, subprocess::env_map_t env = {}) {
+        args.insert(args.begin(), "git");
+        auto result = runCommand(args, env);
+        if (result.retcode != 0) {
+            throw std::runtime_error(
+                estd::string_util::joinAll(args, " ") + " returned a non zero exit code\n" + result.out + result.err
+            );
+        }
+        return estd::string_util::replace_all(result.out, "\n", "");
+    }
+
+    inline bool isCommitHash(const std::string& ref) { return ref.size() >= 7 && ref.size() <= 40 && isHexString(ref); }
+} // namespace
+
+// Fetches single revisions into persistent bare mirrors (one per url) and checks out only the requested subtree.
+//
+// The mirrors are partial clones (--filter=blob:none), so only the blobs under the checked out path are ever
+// downloaded. Branches, tags and full hashes are fetched with --depth 1, abbreviated hashes cannot be requested
+// from a server so for those the mirror is filled with the (blobless) history once and the hash is resolved
+// locally. Later runs reuse the mirror and only fetch what is new.
+class GitFetcher {
+private:
+    Path mirrorRoot;
+
+    Path mirrorPath(const std::string& url) { return mirrorRoot / (sha256Hex(url) + ".git"); }
+
+    void initMirror(Path mirror, const std::string& url) {
+        if (std::filesystem::exists((mirror / "HEAD").string())) return;
+        std::filesystem::create_directories(mirror.string());
+        runGit({"init", "-q", "--bare", mirror});
+        for (auto [key, value] : std::vector<std::pair<std::string, std::string>>{
+                 {"remote.origin.url", url},
+                 {"remote.origin.promisor", "true"},
+                 {"remote.origin.partialclonefilter", "blob:none"},
+                 {"core.repositoryformatversion", "1"},
+                 {"extensions.partialClone", "origin"},
+                 {"gc.auto", "0"},
+             }) {
+            runGit({"-C", mirror, "config", key, value});
+        }
+    }
+
+    std::string resolveLocal(Path mirror, const std::string& ref) {
+        auto result = runCommand({"git", "-C", mirror, "rev-parse", "--verify", "-q", ref + "^{commit}"});
+        if (result.retcode != 0) return "";
+        return estd::string_util::replace_all(result.out, "\n", "");
+    }
+
+    std::string resolve(Path mirror, const std::string& ref) {
+        // a commit we already have can not change, no need to ask the server
+        if (isCommitHash(ref)) {
+            std::string local = resolveLocal(mirror, ref);
+            if (local != "") return local;
+        }
+
+        auto shallow = runCommand(
+            {"git", "-C", mirror, "fetch", "-q", "--filter=blob:none", "--depth=1", "--no-tags", "origin", ref}
+        );
+        if (shallow.retcode == 0) return runGit({"-C", mirror, "rev-parse", "FETCH_HEAD^{commit}"});
+
+        if (!isCommitHash(ref)) {
+            throw std::runtime_error("git fetch of " + ref + " returned a non zero exit code\n" + shallow.err);
+        }
+
+        // abbreviated hashes can only be resolved against the history
+        std::vector<std::string> fetch = {"-C", mirror, "fetch", "-q", "--filter=blob:none", "origin"};
+        if (std::filesystem::exists((mirror / "shallow").string())) fetch.push_back("--unshallow");
+        fetch.push_back("+refs/heads/*:refs/remotes/origin/*");
+        fetch.push_back("+refs/tags/*:refs/tags/*");
+        runGit(fetch);
+        std::string local = resolveLocal(mirror, ref);
+        if (local == "") throw std::runtime_error("git: could not find revision " + ref);
+        return local;
+    }
+
+    // "<ref> <commit>" lines, what every ref resolved to the last time it was fetched into the mirror
+    Path fetchedFile(Path mirror) { return mirror / "dep-pull-fetched"; }
+
+    std::map<std::string, std::string> readFetched(Path mirror) {
+        std::map<std::string, std::string> result;
+        std::ifstream in(fetchedFile(mirror).string());
+        std::string ref, commit;
+        while (in >> ref >> commit) result[ref] = commit;
+        return result;
+    }
+
+    // must be called with the mirror lock held
+    void recordFetched(Path mirror, const std::string& ref, const std::string& commit) {
+        auto fetched = readFetched(mirror);
+        if (fetched[ref] == commit) return;
+        fetched[ref] = commit;
+        Path tmp = fetchedFile(mirror).string() + ".tmp";
+        {
+            std::ofstream out(tmp.string());
+            for (auto& [r, c] : fetched) out << r << " " << c << "\n";
+        }
+        std::filesystem::rename(tmp.string(), fetchedFile(mirror).string());
+    }
+
+    // sparse patterns are anchored gitignore patterns relative to the repo root
+    std::string sparsePattern(Path sourcePath) {
+        std::string p = sourcePath.normalize().string();
+        if (p == "./" || p == "." || p == "") return "/*";
+        if (estd::string_util::hasPrefix(p, "./")) p = p.substr(2);
+        return "/" + p;
+    }
+
+public:
+    GitFetcher(Path mirrorRoot) : mirrorRoot(mirrorRoot) { std::filesystem::create_directories(mirrorRoot.string()); }
+
+    // checks out sourcePath of url at ref into destination (without a .git directory), returns the commit hash. Only
+    // the paths below sourcePath that filter selects are checked out, so the blobs of the others are never fetched.
+    std::string fetch(
+        const std::string& url, const std::string& ref, Path sourcePath, Path destination,
+        const PathFilter& filter = {}
+    ) {
+        TraceSpan span("git fetch", "git", url + " " + ref);
+        Path mirror = mirrorPath(url);
+        FileLock mirrorLock(mirror.string() + ".lock");
+        initMirror(mirror, url);
+
+        std::string commit = resolve(mirror, ref);
+        runGit({"-C", mirror, "update-ref", "refs/dep-pull/" + commit, commit}); // keep it reachable
+        recordFetched(mirror, ref, commit);
+
+        {
+            std::ofstream sparse((mirror / "info" / "sparse-checkout").string());
+            for (auto& pattern : filter.sparsePatterns(sparsePattern(sourcePath))) sparse << pattern << "\n";
+        }
+        std::filesystem::create_directories(destination.string());
+        Path index = destination.removeEmptySuffix().string() + ".index";
+        std::shared_ptr<void> removeIndex(nullptr, [&](void*) {
+            std::error_code ec;
+            std::filesystem::remove(index.string(), ec);
+        });
+        runGit(
+            {"--git-dir=" + mirror.string(),
+             "--work-tree=" + destination.string(),
+             "-c",
+             "core.sparseCheckout=true",
+             "-c",
+             "core.sparseCheckoutCone=false",
+             "read-tree",
+             "--reset",
+             "-u",
+             commit},
+            {{"GIT_INDEX_FILE", index}}
+        );
+        return commit;
+    }
+
+    // whether ref is the commit (or an abbreviation of the commit) it resolved to the last time, such a ref never
+    // moves, a branch or tag that only looks like a hash does not resolve to itself
+    bool isPinned(const std::string& url, const std::string& ref) {
+        if (!isCommitHash(ref)) return false;
+        std::string lower = ref;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return char(tolower(c)); });
+        return estd::string_util::hasPrefix(fetched(url, ref), lower);
+    }
+
+    // the commit the last fetch of ref from url resolved to, empty if it was never fetched into this mirror
+    std::string fetched(const std::string& url, const std::string& ref) {
+        Path mirror = mirrorPath(url);
+        if (!std::filesystem::exists((mirror / "HEAD").string())) return "";
+        FileLock mirrorLock(mirror.string() + ".lock");
+        auto result = readFetched(mirror);
+        return result.count(ref) ? result[ref] : "";
+    }
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <common/xxhash.h> // the copy inside zstd, its symbols are prefixed with ZSTD_
+#include <estd/filesystem.hpp>
+#include <fstream>
+#include <memory>
+#include <openssl/evp.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using estd::files::Path;
+
+class Sha256 {
+private:
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx{EVP_MD_CTX_new(), &EVP_MD_CTX_free};
+
+public:
+    Sha256() {
+        if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) != 1)
+            throw std::runtime_error("sha256: failed to initialize digest");
+    }
+
+    Sha256& update(const void* data, size_t len) {
+        EVP_DigestUpdate(ctx.get(), data, len);
+        return *this;
+    }
+    Sha256& update(const std::string& s) { return update(s.data(), s.size()); }
+
+    Sha256& updateFile(Path file) {
+        std::ifstream f(file.string(), std::ios::in | std::ios::binary);
+        if (!f) throw std::runtime_error("sha256: could not open " + file.string());
+        std::unique_ptr<char[]> buffer(new char[1 << 20]);
+        while (f) {
+            f.read(buffer.get(), 1 << 20);
+            update(buffer.get(), f.gcount());
+        }
+        return *this;
+    }
+
+    std::string hexDigest() {
+        std::array<unsigned char, EVP_MAX_MD_SIZE> md;
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(ctx.get(), md.data(), &len);
+        static const char* hex = "0123456789abcdef";
+        std::string result;
+        for (unsigned int i = 0; i < len; i++) {
+            result += hex[md[i] >> 4];
+            result += hex[md[i] & 15];
+        }
+        return result;
+    }
+};
+
+// commit hashes (also abbreviated ones) and checksums as they are written in vendor.txt and package indexes
+inline bool isHexString(const std::string& s) {
+    return !s.empty() && std::all_of(s.begin(), s.end(), [](char c) { return isxdigit((unsigned char)c); });
+}
+
+inline std::string sha256Hex(const std::string& s) { return Sha256().update(s).hexDigest(); }
+inline std::string sha256File(Path file) { return Sha256().updateFile(file).hexDigest(); }
+
+// fast non cryptographic hash, used to notice local modifications of installed files
+inline uint64_t xxh64File(Path file) {
+    std::ifstream f(file.string(), std::ios::in | std::ios::binary);
+    if (!f) throw std::runtime_error("xxh64: could not open " + file.string());
+    std::unique_ptr<XXH64_state_t, decltype(&XXH64_freeState)> state(XXH64_createState(), &XXH64_freeState);
+    XXH64_reset(state.get(), 0);
+    thread_local std::vector<char> buffer(1 << 20);
+    while (f) {
+        f.read(buffer.data(), buffer.size());
+        XXH64_update(state.get(), buffer.data(), f.gcount());
+    }
+    return XXH64_digest(state.get());
+}
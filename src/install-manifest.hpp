@@ -0,0 +1,271 @@
+#pragma once
+
+#include "conflict-index.hpp"
+#include "hash.hpp"
+#include "scheduler.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <estd/filesystem.hpp>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+using estd::files::Path;
+
+// Every run leaves one manifest per repo in .dep-pull/manifests: the files it installed relative to the project, with
+// their size and xxh64. The next run checks the files of the old manifests that no repo installed this time against
+// them and deletes the ones that are unchanged, so stale files disappear without walking the vendor tree and local
+// edits are never lost.
+//
+// Format: the repo id on the first line, then one "<size> <xxh64 hex> <path>" line per file.
+struct ManifestEntry {
+    std::string path;
+    uint64_t size = 0;
+    uint64_t hash = 0;
+};
+
+struct Manifest {
+    std::vector<ManifestEntry> entries;
+    int64_t written = 0; // mtime of the manifest file in nanoseconds
+};
+
+namespace {
+    // size and hash of what is at file, symlinks are described by their target
+    inline std::optional<ManifestEntry> describeInstalled(std::filesystem::path file) {
+        std::error_code ec;
+        auto status = std::filesystem::symlink_status(file, ec);
+        ManifestEntry e;
+        if (status.type() == std::filesystem::file_type::symlink) {
+            std::string target = std::filesystem::read_symlink(file, ec).string();
+            if (ec) return std::nullopt;
+            e.size = target.size();
+            e.hash = XXH64(target.data(), target.size(), 0);
+        } else if (status.type() == std::filesystem::file_type::regular) {
+            e.size = std::filesystem::file_size(file, ec);
+            if (ec) return std::nullopt;
+            e.hash = xxh64File(file.string());
+        } else {
+            return std::nullopt;
+        }
+        return e;
+    }
+
+    inline int64_t nanoseconds(const struct timespec& t) { return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec; }
+
+    // Like describeInstalled, but a file whose inode did not change since the manifest that lists it as old was
+    // written (ctime, which unlike mtime can not be set back) and that still has the same size keeps the hash of the
+    // manifest instead of being read again.
+    inline std::optional<ManifestEntry> describeInstalledSince(
+        std::filesystem::path file, const ManifestEntry* old, int64_t written
+    ) {
+        struct stat st;
+        if (old && ::lstat(file.c_str(), &st) == 0 && uint64_t(st.st_size) == old->size &&
+            nanoseconds(st.st_ctim) < written) {
+            return *old;
+        }
+        return describeInstalled(file);
+    }
+
+    // calls f(begin, end) for about 4 * jobs slices of [0, count) on the cpu lane, small counts on the calling thread
+    template <class F> void forEachSlice(size_t count, int jobs, F f) {
+        size_t slices = size_t(std::max(1, jobs)) * 4;
+        size_t sliceSize = std::max<size_t>(64, (count + slices - 1) / slices);
+        if (jobs <= 1 || count <= sliceSize) {
+            f(size_t(0), count);
+            return;
+        }
+        TaskGroup group;
+        for (size_t begin = 0; begin < count; begin += sliceSize) {
+            size_t end = std::min(count, begin + sliceSize);
+            group.run(Lane::cpu, [=, &f] { f(begin, end); });
+        }
+        group.wait();
+    }
+
+    inline std::filesystem::path projectDirectory(Path projectRoot) {
+        std::filesystem::path root = std::filesystem::path(projectRoot.string()).lexically_normal();
+        if (root.filename().empty()) root = root.parent_path();
+        return root;
+    }
+
+    // adds the entries of one manifest file to result, returns its repo or an empty string
+    inline std::string readManifest(std::istream& in, std::map<std::string, Manifest>& result) {
+        std::string repo, line;
+        if (!std::getline(in, repo)) return "";
+        auto& entries = result[repo].entries;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            ManifestEntry e;
+            fields >> e.size >> std::hex >> e.hash;
+            fields.get();
+            std::getline(fields, e.path);
+            if (fields && !e.path.empty()) entries.push_back(e);
+        }
+        return repo;
+    }
+
+    inline std::map<std::string, Manifest> loadManifests(std::filesystem::path dir) {
+        std::map<std::string, Manifest> result;
+        std::error_code ec;
+        for (auto& file : std::filesystem::directory_iterator(dir, ec)) {
+            std::ifstream in(file.path());
+            std::string repo = readManifest(in, result);
+            struct stat st;
+            if (!repo.empty() && ::stat(file.path().c_str(), &st) == 0) result[repo].written = nanoseconds(st.st_mtim);
+        }
+        return result;
+    }
+
+    // removes the now empty directories above file, stopping at root
+    inline void pruneEmptyParents(std::filesystem::path file, std::filesystem::path root) {
+        std::error_code ec;
+        for (auto dir = file.parent_path(); dir != root && dir.string().size() > root.string().size();
+             dir = dir.parent_path()) {
+            if (!std::filesystem::is_empty(dir, ec) || ec || !std::filesystem::remove(dir, ec)) return;
+        }
+    }
+} // namespace
+
+// Deletes the files of the previous manifests that are not installed anymore (installed(file) is false) and are
+// unchanged since, the modified ones are kept with a warning.
+template <class F>
+void removeStale(const std::map<std::string, Manifest>& previous, std::filesystem::path root, F installed) {
+    size_t removed = 0;
+    for (auto& [repo, manifest] : previous) {
+        for (auto& old : manifest.entries) {
+            std::filesystem::path file = (root / old.path).lexically_normal();
+            if (installed(file)) continue;
+            auto current = describeInstalled(file);
+            if (!current) continue;
+            if (current->size != old.size || current->hash != old.hash) {
+                std::cout << "[WARNING] keeping " << old.path << ", it is no longer installed by (" << repo
+                          << ") but was modified since" << std::endl;
+                continue;
+            }
+            std::error_code ec;
+            if (std::filesystem::remove(file, ec)) {
+                removed++;
+                pruneEmptyParents(file, root);
+            }
+        }
+    }
+    if (removed) std::cout << "Removed " << removed << " stale files" << std::endl;
+}
+
+// The manifests of the last run and the repos with a file that changed or disappeared since then.
+struct InstalledState {
+    std::map<std::string, Manifest> manifests;
+    std::set<std::string> modified;
+};
+
+// Compares the project against the manifests of the last run, only the files that were touched since are read.
+inline InstalledState checkInstalled(Path projectRoot, int jobs) {
+    std::filesystem::path root = projectDirectory(projectRoot);
+    InstalledState state;
+    state.manifests = loadManifests(root / ".dep-pull" / "manifests");
+
+    std::vector<std::pair<const std::string*, const ManifestEntry*>> files;
+    std::vector<int64_t> written;
+    for (auto& [repo, manifest] : state.manifests) {
+        for (auto& e : manifest.entries) {
+            files.push_back({&repo, &e});
+            written.push_back(manifest.written);
+        }
+    }
+    std::vector<char> intact(files.size());
+    forEachSlice(files.size(), jobs, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            auto current = describeInstalledSince(root / files[i].second->path, files[i].second, written[i]);
+            intact[i] = current && current->size == files[i].second->size && current->hash == files[i].second->hash;
+        }
+    });
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!intact[i]) state.modified.insert(*files[i].first);
+    }
+    return state;
+}
+
+// Lets repo own the files its manifest lists, for a statement that keeps what the last run installed instead of
+// installing it again.
+inline void claimInstalled(ConflictIndex& index, const std::string& repo, const Manifest& manifest, Path projectRoot) {
+    std::filesystem::path root = projectDirectory(projectRoot);
+    ConflictIndex::RepoId id = index.repo(repo);
+    for (auto& e : manifest.entries) index.claim((root / e.path).lexically_normal().string(), id, false);
+}
+
+// Deletes the stale files of the previous run and writes the manifests of this one, which are returned by repo.
+// Only call it after a run in which every statement succeeded, otherwise the files of a failed statement would look
+// stale.
+inline std::map<std::string, std::vector<ManifestEntry>> updateManifests(
+    ConflictIndex& index, Path projectRoot, int jobs
+) {
+    std::filesystem::path root = projectDirectory(projectRoot);
+    std::filesystem::path state = root / ".dep-pull";
+    std::filesystem::path dir = state / "manifests";
+
+    // files that were not touched since the last run keep their hash, see describeInstalledSince
+    auto previous = loadManifests(dir);
+    std::map<std::string, std::pair<const ManifestEntry*, int64_t>> known;
+    for (auto& [repo, manifest] : previous) {
+        for (auto& e : manifest.entries) known[e.path] = {&e, manifest.written};
+    }
+
+    removeStale(previous, root, [&](const std::filesystem::path& file) {
+        return index.owner(file.string()) != ConflictIndex::noRepo;
+    });
+
+    std::vector<std::pair<ManifestEntry, ConflictIndex::RepoId>> files;
+    index.forEachFile([&](Path path, ConflictIndex::RepoId repo) {
+        ManifestEntry e;
+        e.path = std::filesystem::path(path.string()).lexically_relative(root).string();
+        files.push_back({e, repo});
+    });
+
+    // hashing reads every installed byte once, spread it over the cpu lane in slices like installFiles
+    std::vector<char> present(files.size());
+    forEachSlice(files.size(), jobs, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            auto it = known.find(files[i].first.path);
+            auto current = it == known.end()
+                               ? describeInstalled(root / files[i].first.path)
+                               : describeInstalledSince(root / files[i].first.path, it->second.first, it->second.second);
+            if (!current) continue; // removed by an rm statement
+            files[i].first.size = current->size;
+            files[i].first.hash = current->hash;
+            present[i] = true;
+        }
+    });
+
+    std::map<ConflictIndex::RepoId, std::vector<ManifestEntry>> byRepo;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (present[i]) byRepo[files[i].second].push_back(files[i].first);
+    }
+
+    std::filesystem::create_directories(dir);
+    if (!std::filesystem::exists(state / ".gitignore")) std::ofstream(state / ".gitignore") << "*";
+    std::map<std::string, std::vector<ManifestEntry>> result;
+    std::set<std::string> written;
+    for (auto& [repo, entries] : byRepo) {
+        std::string name = sha256Hex(index.repoName(repo));
+        std::filesystem::path tmp = dir / (name + ".tmp");
+        {
+            std::ofstream out(tmp);
+            out << index.repoName(repo) << "\n";
+            for (auto& e : entries) out << e.size << " " << std::hex << e.hash << std::dec << " " << e.path << "\n";
+        }
+        std::filesystem::rename(tmp, dir / name);
+        written.insert(name);
+        result[index.repoName(repo)] = std::move(entries);
+    }
+    for (auto& file : std::filesystem::directory_iterator(dir)) {
+        if (!written.count(file.path().filename().string())) std::filesystem::remove(file.path());
+    }
+    return result;
+}
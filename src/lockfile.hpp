@@ -0,0 +1,102 @@
+#pragma once
+
+#include "hash.hpp"
+#include "install-manifest.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct LockedStatement {
+    std::string key;
+    std::string repo;
+    // "commit <sha>" for git, "sha256 <hex>" for tarballs, "package <name> <version> <sha256>" for deb packages
+    std::vector<std::string> resolved;
+    // some files of the repo came from an earlier statement
+    bool shadowed = false;
+    uint64_t files = 0;
+    uint64_t outputs = 0; // manifestDigest of the files of the repo
+};
+
+// dep-pull.lock records what the last successful run installed, so the next one can tell what it has to do again.
+// The spec is a hash of vendor.txt and every file it includes, every statement is listed with its key (see
+// VendorStatement::key), what it resolved to and a digest of the manifest of its repo (.dep-pull/manifests has the
+// files themselves). A project can commit it, it holds nothing that depends on the machine.
+//
+// Format: "dep-pull.lock 1", "spec <sha256>", then per statement "statement <key>" followed by indented
+// "repo <repo>", resolved, "shadowed" and "outputs <files> <digest>" lines.
+struct Lockfile {
+    static constexpr const char* header = "dep-pull.lock 1";
+
+    std::string spec;
+    std::vector<LockedStatement> statements;
+
+    // false if there is no lockfile or it was written by an incompatible version
+    bool load(std::filesystem::path file) {
+        std::ifstream in(file);
+        std::string line;
+        if (!std::getline(in, line) || line != header) return false;
+        while (std::getline(in, line)) {
+            std::string field, value;
+            size_t begin = line.find_first_not_of(' ');
+            if (begin == std::string::npos) continue;
+            size_t space = line.find(' ', begin);
+            field = line.substr(begin, space == std::string::npos ? std::string::npos : space - begin);
+            if (space != std::string::npos) value = line.substr(space + 1);
+
+            if (field == "spec") {
+                spec = value;
+            } else if (field == "statement") {
+                statements.push_back({});
+                statements.back().key = value;
+            } else if (statements.empty()) {
+                return false;
+            } else if (field == "repo") {
+                statements.back().repo = value;
+            } else if (field == "shadowed") {
+                statements.back().shadowed = true;
+            } else if (field == "outputs") {
+                std::istringstream fields(value);
+                fields >> statements.back().files >> std::hex >> statements.back().outputs;
+            } else {
+                statements.back().resolved.push_back(line.substr(begin));
+            }
+        }
+        return !spec.empty();
+    }
+
+    void save(std::filesystem::path file) const {
+        std::filesystem::path tmp = file.string() + ".tmp";
+        {
+            std::ofstream out(tmp);
+            out << header << "\n";
+            out << "spec " << spec << "\n";
+            for (auto& s : statements) {
+                out << "statement " << s.key << "\n";
+                if (s.repo.empty()) continue;
+                out << "    repo " << s.repo << "\n";
+                for (auto& r : s.resolved) out << "    " << r << "\n";
+                if (s.shadowed) out << "    shadowed\n";
+                out << "    outputs " << s.files << " " << std::hex << std::setw(16) << std::setfill('0') << s.outputs
+                    << std::dec << std::setfill(' ') << "\n";
+            }
+            if (!out) throw std::runtime_error("could not write " + tmp.string());
+        }
+        std::filesystem::rename(tmp, file);
+    }
+};
+
+// xxh64 over the sorted entries of a manifest, independent of the order they were installed in
+inline uint64_t manifestDigest(std::vector<ManifestEntry> entries) {
+    std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return a.path < b.path; });
+    std::ostringstream listing;
+    listing << std::hex;
+    for (auto& e : entries) listing << e.path << '\0' << e.size << ' ' << e.hash << '\n';
+    std::string s = listing.str();
+    return XXH64(s.data(), s.size(), 0);
+}
@@ -41,19 +41,35 @@
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 #include <httplib.h>
 
+#include "bundle.hpp"
 #include "conflict-detector.hpp"
+#include "daemon.hpp"
+#include "downloader.hpp"
+#include "git-fetcher.hpp"
+#include "install-manifest.hpp"
+#include "lockfile.hpp"
 #include "omtl/ParseTree.hpp"
 #include "omtl/Tokenizer.hpp"
+#include "options.hpp"
+#include "parallel-decompress.hpp"
+#include "path-filter.hpp"
 #include "repo-cache.hpp"
-#include <bxzstr.hpp>
+#include "scheduler.hpp"
+#include "statement-scheduler.hpp"
+#include "tar-index.hpp"
+#include "tar-stream.hpp"
+#include "trace.hpp"
 #include <deb/deb-downloader.hpp>
 #include <estd/AnsiEscape.hpp>
 #include <estd/filesystem.hpp>
 #include <estd/ptr.hpp>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <set>
+#include <sstream>
 #include <subprocess/subprocess.hpp>
 #include <tar/tar.hpp>
 #include <thread>
@@ -68,71 +84,15 @@ using estd::files::Path;
 cptr<deb::Installer> debInstaller;
 jptr<estd::files::TmpDir> temp;
 cptr<RepoCache> repoCache;
+cptr<GitFetcher> gitFetcher;
+cptr<Downloader> downloader;
+jptr<ArtifactStore> store;
+Options options;
 
-tuple<string, string, string> splitUrl(string url) {
-    std::string delimiter = " ";
-    std::string scheme = "";
-    std::string host = "";
-    std::string path = "";
+// threads writing the files of one archive, more of them mostly wait for the same directory locks
+unsigned writerThreads() { return unsigned(std::min(options.jobs, 4)); }
 
-    size_t pos = 0;
-    std::string token;
-
-    delimiter = "://";
-    if ((pos = url.find(delimiter)) != std::string::npos) {
-        token = url.substr(0, pos + delimiter.length());
-        scheme = token;
-        url.erase(0, pos + delimiter.length());
-    }
-
-    delimiter = "/";
-    if ((pos = url.find(delimiter)) != std::string::npos) {
-        token = url.substr(0, pos);
-        host = token;
-        url.erase(0, pos);
-    }
-
-    path = url;
-
-    return make_tuple(scheme, host, path);
-}
-
-Path downloadFile(string url, Path location) {
-    std::string scheme = "";
-    std::string host = "";
-    std::string path = "";
-
-    tie(scheme, host, path) = splitUrl(url);
-
-    fs::createDirectories(location.splitSuffix().first);
-
-    ofstream file(location.string());
-
-    httplib::Client cli((scheme + host).c_str());
-    cli.set_follow_location(true);
-    cli.enable_server_certificate_verification(false);
-
-    auto res = cli.Get(
-        path.c_str(),
-        Headers(),
-        [&](const Response& response) {
-            return true; // return 'false' if you want to cancel the request.
-        },
-        [&](const char* data, size_t data_length) {
-            file.write(data, data_length);
-            return true; // return 'false' if you want to cancel the request.
-        }
-    );
-    if (res.error() != httplib::Error::Success) {
-        cout << "[WARNING] got error when downloading " << res.error() << endl;
-    } else if (res->status < 200 && res->status >= 300) {
-        cout << "[WARNING] non 200 exit code " << res->status << endl;
-    }
-    file.close();
-    return location;
-}
-
-void parseMoveCache(Path cache, string repoId, Element tokens) {
+void parseMoveCache(Path cache, string repoId, Element tokens, const PathFilter& filter) {
     if (tokens.size() != 2) {
         cout << "[WARNING] not enough arguments for copy portion of statement at " + tokens.location << endl;
     }
@@ -144,10 +104,53 @@ void parseMoveCache(Path cache, string repoId, Element tokens) {
 
     // cout << src.string() << endl << target.string() << endl;
 
-    copyRepo(repoId, src, target);
+    copyRepo(repoId, src, target, options.installMode, options.jobs, filter);
     // cout << endl;
 }
 
+// the include [...] and exclude [...] lists that may follow the copy portion of a statement, tokens[first] on
+PathFilter parseFilter(Element tokens, size_t first) {
+    vector<string> include, exclude;
+    string location = tokens[0]->getToken().location; // copies of an Element lose their own location
+    for (size_t i = first; i < tokens.size(); i += 2) {
+        string kind = tokens[i]->isName() ? tokens[i]->getName() : "";
+        if ((kind != "include" && kind != "exclude") || i + 1 >= tokens.size())
+            throw runtime_error("expected include [...] or exclude [...] at " + location);
+        auto& patterns = kind == "include" ? include : exclude;
+        auto list = tokens[i + 1];
+        if (list->isString()) {
+            patterns.push_back(list->getString());
+            continue;
+        }
+        if (!list->isTuple()) throw runtime_error("expected a list of patterns at " + location);
+        for (size_t k = 0; k < list->size(); k++) {
+            auto pattern = tokens[i + 1][k];
+            if (!pattern->isString()) throw runtime_error("patterns must be strings at " + location);
+            patterns.push_back(pattern->getString());
+        }
+    }
+    return PathFilter(include, exclude);
+}
+
+// what the filter of a statement adds to the cache key of its tree, its patterns are relative to common
+string filterKey(const PathFilter& filter, Path common) {
+    return filter.empty() ? "" : "filter " + common.string() + "\n" + filter.describe();
+}
+
+// filter for tar::Reader::memberFilter, empty if it selects everything
+std::function<bool(const string&)> memberFilter(const PathFilter& filter) {
+    if (filter.empty()) return {};
+    return [filter](const string& path) { return filter.selected(path); };
+}
+
+// filter for deb::Installer::install, which does not walk into the directories it rejects
+std::function<bool(const string&)> treeFilter(const PathFilter& filter) {
+    if (filter.empty()) return {};
+    return [filter](const string& path) {
+        return path.back() == '/' ? filter.mayContain(path) : filter.selected(path);
+    };
+}
+
 Path parseAheadCommonRoot(Element tokens) {
     if (tokens.size() != 2) {
         cout << "[WARNING] not enough arguments for copy portion of statement at " + tokens.location << endl;
@@ -185,94 +188,171 @@ Path parseAheadCommonRoot(Element tokens) {
 //     parseMoveCache(cache, repoId, tokens.slice(3));
 // }
 
-void parseGit(Element tokens) {
-    using namespace subprocess;
-    if (tokens.size() < 3) { cout << "[WARNING] not enough arguments for git statement at " + tokens.location << endl; }
-
+Path fetchGit(Element tokens, vector<string>& resolved, const PathFilter& filter) {
     string sourceUrl = tokens[1]->getValue();
     string sourceHash = tokens[2]->getValue();
     string repoId = "git " + sourceUrl + " " + sourceHash;
 
-    std::cout << repoId << std::endl;
-
-    Path cache = repoCache->createDir(repoId, "", [&](Path cache) {
-        int retcode = 0;
-        {
-            auto p = Popen({"git", "clone", sourceUrl, cache.string()}, input{PIPE}, output{PIPE}, error(PIPE));
-            auto comm = p.communicate();
-            p.close_input();
-            auto out = comm.first;
-            auto err = comm.second;
-            retcode = p.retcode();
-            // system(("git clone " + sourceUrl + " " + cache.string()).c_str());
-            if (retcode != 0) {
-                cout.clear();
-                cout << "git clone for " << sourceUrl << " returned a non zero exit code\n";
-                cout << out.buf.data() << endl;
-                cout.clear();
-                cout << err.buf.data() << endl;
-                cout.clear();
-                return;
-            }
-        }
-
-        {
-            auto p =
-                Popen({"git", "-C", cache.string(), "checkout", sourceHash}, input{PIPE}, output{PIPE}, error(PIPE));
-            auto comm = p.communicate();
-            p.close_input();
-            auto out = comm.first;
-            auto err = comm.second;
-            retcode = p.retcode();
-            // system(("git -C " + cache.string() + " chechout " + sourceHash).c_str());
-            if (retcode != 0) {
-                cout.clear();
-                cout << "git checkout for " << sourceUrl << " returned a non zero exit code\n";
-                cout << out.buf.data() << endl;
-                cout.clear();
-                cout << err.buf.data() << endl;
-                cout.clear();
-                return;
-            }
-        }
-        // cout << "rm " << cache / ".git/" << endl;
-        estd::files::remove(cache / ".git/");
-    });
-
-    parseMoveCache(cache, repoId, tokens.slice(3));
+    std::cout << repoId + "\n" << std::flush;
+
+    string commit;
+    Path cache;
+    // a tree of a commit never goes stale, only the mirror knows whether the ref is one
+    bool pinned = gitFetcher->isPinned(sourceUrl, sourceHash);
+    if (options.gitMode == "clone") {
+        cache = repoCache->createDir(
+            repoId, "",
+            [&](Path cache) {
+                runGit({"clone", "-q", sourceUrl, cache.string()});
+                runGit({"-C", cache.string(), "checkout", "-q", sourceHash});
+                commit = runGit({"-C", cache.string(), "rev-parse", "HEAD"});
+                estd::files::remove(cache / ".git/");
+            },
+            "", pinned
+        );
+    } else {
+        Path common = parseAheadCommonRoot(tokens.slice(3, 5));
+        cache = repoCache->createDir(
+            repoId, common,
+            [&](Path cache) { commit = gitFetcher->fetch(sourceUrl, sourceHash, common, cache, filter); },
+            filterKey(filter, common), pinned
+        );
+        // cached, the mirror still knows which commit that was
+        if (commit.empty()) commit = gitFetcher->fetched(sourceUrl, sourceHash);
+    }
+    if (!commit.empty()) resolved.push_back("commit " + commit);
+    return cache;
 }
 
-void parseTar(Element tokens) {
-    if (tokens.size() < 2) { cout << "[WARNING] not enough arguments for tar statement at " + tokens.location << endl; }
+VendorStatement parseGit(Element tokens) {
+    if (tokens.size() < 3) { cout << "[WARNING] not enough arguments for git statement at " + tokens.location << endl; }
 
-    string sourceUrl = tokens[1]->getValue();
-    string repoId = "tar " + sourceUrl;
+    string repoId = "git " + tokens[1]->getValue() + " " + tokens[2]->getValue();
+    PathFilter filter = parseFilter(tokens, 5);
+
+    VendorStatement s;
+    s.description = repoId;
+    s.lane = repoId;
+    s.key = sha256Hex(tokens.getDiagnosticString());
+    s.repo = repoId;
+    s.fetch = [=](vector<string>& resolved) { return fetchGit(tokens, resolved, filter); };
+    s.install = [=](Path cache) mutable { parseMoveCache(cache, repoId, tokens.slice(3, 5), filter); };
+    return s;
+}
 
-    Path common = parseAheadCommonRoot(tokens.slice(2));
+vector<tar::IndexEntry> extractTarClassic(Path archive, Path common, Path cache, const PathFilter& filter) {
+    TraceSpan span("extract", "tar", archive.string());
+    ParallelDecompressStream zFile(archive.string(), options.decompressThreads);
+    tar::Reader r(zFile);
+    r.writerThreads = writerThreads();
+    r.memberFilter = memberFilter(filter);
+    r.extractPath(common, cache / common);
+    traceWritten(r);
+    return r.getIndex();
+}
 
-    Path cache = repoCache->createDir(repoId, common, [&](Path cache) {
-        string filename = repoCache->getFilePath(repoId);
+// the first extraction of an archive reads all of it and keeps its index next to it in the cache, later extractions
+// of other subpaths use the index to only decompress and read what they need, members the filter rejects are skipped
+void extractTar(string sourceUrl, string repoId, Path archive, Path common, Path cache, const PathFilter& filter) {
+    cout << "Extracting .tar package " << sourceUrl << endl;
 
-        if (!std::filesystem::exists(filename)) {
-            cout << "Downloading .tar package " << sourceUrl << endl;
-            downloadFile(sourceUrl, repoCache->getFilePath(repoId));
-        }
+    bool indexed = false;
+    Path indexFile = repoCache->createFile(repoId + "\ntar-index", [&](Path location) {
+        TarIndex(archive, extractTarClassic(archive, common, cache, filter)).save(location);
+        indexed = true;
+    });
+    if (indexed) return;
 
-        bxz::ifstream zFile = bxz::ifstream(filename);
-        tar::Reader r(zFile);
+    TarIndex index(archive, indexFile);
+    if (!index.valid()) {
+        extractTarClassic(archive, common, cache, filter);
+        return;
+    }
+    TraceSpan span("indexed extract", "tar", sourceUrl);
+    std::istream& tarStream = index.open([&] {
+        return repoCache->createFile(repoId + "\ntar-plain", [&](Path location) {
+            TraceSpan span("decompress", "tar", sourceUrl);
+            ParallelDecompressStream zFile(archive.string(), options.decompressThreads);
+            ofstream plain(location.string(), ios::out | ios::binary);
+            plain << zFile.rdbuf();
+        });
+    });
+    tar::Reader r(tarStream);
+    r.writerThreads = writerThreads();
+    r.memberFilter = memberFilter(filter);
+    index.loadInto(r);
+    r.extractPath(common, cache / common);
+    traceWritten(r);
+}
 
-        cout << "Extracting .tar package " << sourceUrl << endl;
+Path fetchTar(Element tokens, vector<string>& resolved, const PathFilter& filter) {
+    string sourceUrl = tokens[1]->getValue();
+    string repoId = "tar " + sourceUrl;
 
+    Path common = parseAheadCommonRoot(tokens.slice(2, 4));
 
-        r.extractPath(common, cache / common);
+    string archiveHash;
+    auto extract = [&](Path cache) {
+        bool streamed = false, extracted = false;
+        vector<tar::IndexEntry> entries;
+        Path filename = repoCache->createFile(repoId, [&](Path location) {
+            if (options.tarMode == "classic") {
+                cout << "Downloading .tar package " << sourceUrl << endl;
+                downloader->downloadFile(sourceUrl, location);
+                return;
+            }
+            cout << "Downloading and extracting .tar package " << sourceUrl << endl;
+            fs::createDirectories(location.splitSuffix().first);
+            streamed = true;
+            extracted = streamTar(
+                [&](auto receiver) { downloader->get(sourceUrl, receiver); }, location, common, cache / common, entries,
+                options.decompressThreads, writerThreads(), memberFilter(filter)
+            );
+        });
+        archiveHash = repoCache->fileHash(filename);
+        if (extracted) {
+            repoCache->createFile(repoId + "\ntar-index", [&](Path location) {
+                TarIndex(filename, entries).save(location);
+            });
+            return;
+        }
 
-        zFile.close();
+        // the archive was cached already, or it needs a second pass for its links
+        if (streamed) estd::files::remove(cache / common);
+        extractTar(sourceUrl, repoId, filename, common, cache, filter);
+    };
+    Path tree = repoCache->createDir(repoId, common, extract, filterKey(filter, common));
+    // kept for cached trees, whose archive may be gone already
+    Path hashFile = repoCache->createFile(repoId + "\nsha256", [&](Path location) {
+        if (archiveHash.empty()) {
+            archiveHash = repoCache->fileHash(repoCache->createFile(repoId, [&](Path location) {
+                downloader->downloadFile(sourceUrl, location);
+            }));
+        }
+        ofstream(location.string()) << archiveHash << "\n";
     });
+    if (archiveHash.empty()) ifstream(hashFile.string()) >> archiveHash;
+    resolved.push_back("sha256 " + archiveHash);
+    return tree;
+}
 
-    parseMoveCache(cache, repoId, tokens.slice(2));
+VendorStatement parseTar(Element tokens) {
+    if (tokens.size() < 2) { cout << "[WARNING] not enough arguments for tar statement at " + tokens.location << endl; }
+
+    string repoId = "tar " + tokens[1]->getValue();
+    PathFilter filter = parseFilter(tokens, 4);
+
+    VendorStatement s;
+    s.description = repoId;
+    s.lane = repoId;
+    s.key = sha256Hex(tokens.getDiagnosticString());
+    s.repo = repoId;
+    s.fetch = [=](vector<string>& resolved) { return fetchTar(tokens, resolved, filter); };
+    s.install = [=](Path cache) mutable { parseMoveCache(cache, repoId, tokens.slice(2, 4), filter); };
+    return s;
 }
 
-void parseDebInit(Element tokens) {
+void applyDebInit(Element tokens) {
     std::vector<std::string> sources;
     if (tokens.size() < 2) {
         cout << "[WARNING] not enough arguments for deb-repo statement at " + tokens.location << endl;
@@ -294,7 +374,7 @@ void parseDebInit(Element tokens) {
     }
 }
 
-void parseDebRecurseDepth(Element tokens) {
+void applyDebRecurseDepth(Element tokens) {
     if (tokens.size() < 2) {
         cout << "[WARNING] not enough arguments for deb-recurse-limit statement at " + tokens.location << endl;
     }
@@ -302,29 +382,114 @@ void parseDebRecurseDepth(Element tokens) {
     debInstaller->recursionLimit = recurseDepth;
 }
 
-void parseDebMarkInstall(Element tokens) {
+void applyDebMarkInstall(Element tokens) {
     if (tokens.size() < 2) {
         cout << "[WARNING] not enough arguments for deb-ignore statement at " + tokens.location << endl;
     }
     for (size_t i = 1; i < tokens.size(); i++) { debInstaller->markPreInstalled({tokens[i]->getValue()}); }
 }
 
-void parseDebInstall(Element tokens) {
-    if (tokens.size() < 2) { cout << "[WARNING] not enough arguments for deb statement at " + tokens.location << endl; }
+// the deb-init, deb-recurse-limit and deb-ignore statements so far, they decide what a deb statement installs
+string debConfiguration;
+
+// deb statements share the installer state, so they all run in one lane in declaration order
+VendorStatement debStatement(Element tokens, std::function<void(Element)> func) {
+    VendorStatement s;
+    s.description = tokens.getDiagnosticString();
+    s.lane = "deb";
+    s.key = sha256Hex(s.description);
+    s.fetch = [=](vector<string>&) {
+        func(tokens);
+        return Path();
+    };
+    debConfiguration += s.description + "\n";
+    return s;
+}
+
+VendorStatement parseDebInit(Element tokens) { return debStatement(tokens, applyDebInit); }
+VendorStatement parseDebRecurseDepth(Element tokens) { return debStatement(tokens, applyDebRecurseDepth); }
+VendorStatement parseDebMarkInstall(Element tokens) { return debStatement(tokens, applyDebMarkInstall); }
+
+void printDebPlan(string packages) {
+    auto plan = debInstaller->plan(packages);
+    uint64_t total = 0;
+    for (auto& p : plan) total += p.size;
+    cout << "deb " << packages << ": " << plan.size() << " packages, " << formatSize(total) << " to download\n";
+    for (auto& p : plan) {
+        cout << "    " << p.name;
+        if (p.requestedAs != p.name) cout << " (for " << p.requestedAs << ")";
+        cout << "  " << formatSize(p.size) << "  " << p.url << "\n";
+    }
+    cout << std::flush;
+}
+
+Path fetchDebInstall(Element tokens, vector<string>& resolved, const PathFilter& filter) {
     string repoId = "deb " + tokens[1]->getValue();
+    if (options.plan) {
+        printDebPlan(tokens[1]->getValue());
+        return Path();
+    }
 
-    Path common = parseAheadCommonRoot(tokens.slice(2));
+    Path common = parseAheadCommonRoot(tokens.slice(2, 4));
+
+    // the installed set depends on the configured sources, not just the package names
+    string fingerprint = "recurse-limit " + to_string(debInstaller->recursionLimit);
+    for (auto& source : debInstaller->sourcesList) fingerprint += "\nsource " + source;
+    for (auto& pkg : debInstaller->preInstalled) fingerprint += "\nignore " + pkg;
+    if (!filter.empty()) fingerprint += "\n" + filterKey(filter, common);
+
+    vector<deb::PlannedPackage> packages;
+    bool installed = false;
+    Path tree = repoCache->createDir(
+        repoId,
+        common,
+        [&](Path cache) {
+            cout << "Installing .deb package " << tokens[1]->getValue() << endl;
+            TraceSpan span("deb install", "deb", tokens[1]->getValue());
+            uint64_t files = debInstaller->filesWritten, bytes = debInstaller->bytesWritten;
+            packages = debInstaller->install(tokens[1]->getValue(), {{common, cache / common}}, treeFilter(filter));
+            debInstaller->clearInstalled();
+            installed = true;
+            tracer.count("files written", int64_t(debInstaller->filesWritten - files));
+            tracer.count("bytes written", int64_t(debInstaller->bytesWritten - bytes));
+        },
+        fingerprint
+    );
 
-    Path cache = repoCache->createDir(repoId, common, [&](Path cache) {
-        cache = repoCache->access(repoId);
-        cout << "Installing .deb package " << tokens[1]->getValue() << endl;
-        debInstaller->install(tokens[1]->getValue(), {{common, cache / common}});
-        debInstaller->clearInstalled();
+    // the packages are kept next to the tree they were installed into, a cached tree looks them up there
+    Path list = repoCache->createFile("deb-packages " + tree.string(), [&](Path location) {
+        if (!installed) packages = debInstaller->plan(tokens[1]->getValue());
+        ofstream out(location.string());
+        for (auto& p : packages) out << "package " << p.name << " " << p.version << " " << p.sha256 << "\n";
     });
+    ifstream in(list.string());
+    for (string line; getline(in, line);) resolved.push_back(line);
+    return tree;
+}
 
-    parseMoveCache(cache, repoId, tokens.slice(2));
+VendorStatement parseDebInstall(Element tokens) {
+    if (tokens.size() < 2) { cout << "[WARNING] not enough arguments for deb statement at " + tokens.location << endl; }
+    string repoId = "deb " + tokens[1]->getValue();
+    PathFilter filter = parseFilter(tokens, 4);
+
+    VendorStatement s;
+    s.description = repoId;
+    s.lane = "deb";
+    s.key = sha256Hex(debConfiguration + tokens.getDiagnosticString());
+    s.repo = repoId;
+    s.fetch = [=](vector<string>& resolved) { return fetchDebInstall(tokens, resolved, filter); };
+    s.install = [=](Path cache) mutable {
+        if (!options.plan) parseMoveCache(cache, repoId, tokens.slice(2, 4), filter);
+    };
+    return s;
 }
 
+// vendor.txt and everything it includes, in declaration order
+vector<VendorStatement> statements;
+bool parseFailed = false;
+// over the names and contents of vendor.txt and every file it includes
+Sha256 specHash;
+
 void parseBlock(Element pt);
 
 Path includePrefix = "./";
@@ -339,17 +504,27 @@ void parseInclude(Element cmd) {
 
 
     auto pt = ptb.buildParseTree(tkn.tokenize(p));
+    specHash.update(p.string() + '\0').updateFile(p).update("\0", 1);
 
     includePrefix = p.getAntiSuffix();
     parseBlock(pt);
     includePrefix = pwd;
 }
 
-void parseRemove(Element cmd) {
+VendorStatement parseRemove(Element cmd) {
     if (cmd.size() != 2) throw runtime_error("invalid include command at " + cmd.location);
     Path p = cmd[1]->getValue();
-    std::cout << cmd.getDiagnosticString() << std::endl;
-    estd::files::remove(p);
+    string description = cmd.getDiagnosticString();
+
+    VendorStatement s;
+    s.description = description;
+    s.lane = "rm";
+    s.key = sha256Hex(description);
+    s.install = [=](Path) {
+        std::cout << description << std::endl;
+        estd::files::remove(p);
+    };
+    return s;
 }
 
 void parseBlock(Element pt) {
@@ -358,27 +533,30 @@ void parseBlock(Element pt) {
             if (pt[i]->size() <= 0) continue;
 
             if (!pt[i][0]->isName()) {
+                parseFailed = true;
                 cout << "[WARNING] unsupported statement at " << pt[i][0]->location << endl;
             } else if (pt[i][0]->getName() == "git") {
-                parseGit(pt[i].value());
+                statements.push_back(parseGit(pt[i].value()));
             } else if (pt[i][0]->getName() == "tar") {
-                parseTar(pt[i].value());
+                statements.push_back(parseTar(pt[i].value()));
             } else if (pt[i][0]->getName() == "deb-init") {
-                parseDebInit(pt[i].value());
+                statements.push_back(parseDebInit(pt[i].value()));
             } else if (pt[i][0]->getName() == "deb-ignore") {
-                parseDebMarkInstall(pt[i].value());
+                statements.push_back(parseDebMarkInstall(pt[i].value()));
             } else if (pt[i][0]->getName() == "deb-recurse-limit") {
-                parseDebRecurseDepth(pt[i].value());
+                statements.push_back(parseDebRecurseDepth(pt[i].value()));
             } else if (pt[i][0]->getName() == "deb") {
-                parseDebInstall(pt[i].value());
+                statements.push_back(parseDebInstall(pt[i].value()));
             } else if (pt[i][0]->getName() == "rm") {
-                parseRemove(pt[i].value());
+                statements.push_back(parseRemove(pt[i].value()));
             } else if (pt[i][0]->getName() == "include") {
                 parseInclude(pt[i].value());
             } else {
+                parseFailed = true; // a typo must not make the files of the statement look stale
                 cout << "[WARNING] unsupported statement at " << pt[i][0]->location << endl;
             }
         } catch (std::exception& e) {
+            parseFailed = true;
             cout << estd::clearSettings << estd::setTextColor(255, 0, 0);
             cout << "[ERROR] ";
             cout << e.what() << estd::clearSettings << endl;
@@ -388,24 +566,360 @@ void parseBlock(Element pt) {
 
 
 
-int main() {
+// the persistent caches, the HTTP client and the deb installer, only needed once a statement has to be fetched. The
+// daemon sets them up once and keeps them for every run.
+void setUp() {
+    if (downloader) return;
+    srand(time(nullptr));
+    // the daemon serves many projects, its scratch files do not belong into the one it was started in
+    temp = options.daemon ? new estd::files::TmpDir(std::filesystem::temp_directory_path())
+                          : new estd::files::TmpDir();
+    {
+        std::ofstream ff(temp->path() / ".gitignore");
+        ff << "*";
+        ff.close();
+    }
+    downloader = new Downloader();
+    downloader->maxConnections = options.hostConnections;
+    debInstaller = new deb::Installer(new TmpDir(temp->path()));
+    debInstaller->httpGet = [](const string& url, const Headers& headers, Headers& responseHeaders,
+                               std::function<void(const char*, size_t)> receiver) {
+        return downloader->get(url, receiver, headers, &responseHeaders);
+    };
+    debInstaller->fetchFile = [](const string& url, const string& file, uint64_t size) {
+        downloader->downloadFile(url, file, size);
+    };
+    debInstaller->decompress = [](std::istream& compressed) -> std::unique_ptr<std::istream> {
+        return std::make_unique<ParallelDecompressStream>(compressed, options.decompressThreads);
+    };
+    if (!getenv("DEP_PULL_NO_CACHE")) store = ArtifactStore::fromEnvironment();
+    gitFetcher = new GitFetcher(store ? store->root() / "git" : Path(temp->path()) / "git");
+    if (store) debInstaller->indexDirectory = (store->root() / "deb-index").string();
+    // a daemon keeps the Packages indexes in memory as long as the cache keeps git branches
+    if (options.daemon) debInstaller->indexMaxAge = double(store ? store->maxAge() : 24 * 60 * 60);
+    // every .deb is extracted once per run (and kept in the store), deb statements link their files from there
+    debInstaller->packageTree = [](const string& key, std::function<void(const string&)> extract) {
+        return repoCache
+            ->createDir(
+                "deb-package " + key, "./",
+                [&](Path tree) {
+                    TraceSpan span("unpack .deb", "deb", key);
+                    extract(tree.string());
+                }
+            )
+            .string();
+    };
+    // the package lists and the .deb files are io tasks next to the statements, at most as many per host as there
+    // are connections to it so the other tasks do not wait behind a busy mirror
+    debInstaller->runTasks = [](vector<deb::Installer::Task>& tasks) {
+        TaskGroup group;
+        for (auto& t : tasks) group.run(Lane::io, t.run, t.priority, "host " + Downloader::hostOf(t.url));
+        group.wait();
+    };
+}
+
+const char* lockFile = "dep-pull.lock";
+
+// whether the files dep-pull.lock records for the repo of locked are installed and unchanged
+bool outputsIntact(const LockedStatement& locked, const InstalledState& installed) {
+    if (installed.modified.count(locked.repo)) return false;
+    auto it = installed.manifests.find(locked.repo);
+    if (it == installed.manifests.end()) return locked.files == 0;
+    return it->second.entries.size() == locked.files && manifestDigest(it->second.entries) == locked.outputs;
+}
+
+// Lets the statements that dep-pull.lock shows unchanged keep what the last run installed, they are neither fetched
+// nor installed again. A repo is kept when all of its statements are locked with the same keys and its files are
+// intact. A repo that lost files to an earlier statement is only kept if the statements before it are the same and
+// none of them runs again (they may not install those files anymore), and when rm statements were added or removed
+// every statement runs.
+// The statements without a repo (deb-init, ...) run whenever a statement of their lane does. Returns how many
+// statements are kept.
+size_t keepLocked(const Lockfile& lock, const InstalledState& installed) {
+    map<string, vector<string>> lockedKeys, keys;
+    map<string, const LockedStatement*> lockedByKey;
+    set<string> lockedOthers, others;
+    for (auto& l : lock.statements) {
+        if (l.repo.empty()) {
+            lockedOthers.insert(l.key);
+        } else {
+            lockedKeys[l.repo].push_back(l.key);
+            lockedByKey[l.key] = &l;
+        }
+    }
+    set<string> removals;
+    for (auto& s : statements) {
+        if (!s.repo.empty()) keys[s.repo].push_back(s.key);
+        if (s.repo.empty()) others.insert(s.key);
+        if (s.lane == "rm") removals.insert(s.key);
+    }
+    bool removalsChanged = false;
+    for (auto& key : removals) removalsChanged = removalsChanged || !lockedOthers.count(key);
+    for (auto& key : lockedOthers) removalsChanged = removalsChanged || !others.count(key);
+    if (removalsChanged) return 0;
+
+    set<string> kept;
+    for (auto& [repo, repoKeys] : keys) {
+        if (lockedKeys[repo] != repoKeys) continue;
+        if (outputsIntact(*lockedByKey[repoKeys.front()], installed)) kept.insert(repo);
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        bool earlierChanged = false;
+        for (size_t i = 0; i < statements.size(); i++) {
+            auto& s = statements[i];
+            // also true when s moved
+            earlierChanged = earlierChanged || i >= lock.statements.size() || lock.statements[i].key != s.key;
+            if (s.repo.empty()) continue;
+            if (kept.count(s.repo) && lockedByKey[s.key]->shadowed && earlierChanged) {
+                kept.erase(s.repo);
+                changed = true;
+            }
+            earlierChanged = earlierChanged || !kept.count(s.repo);
+        }
+    }
+
+    set<string> runningLanes;
+    for (auto& s : statements) {
+        if (!s.repo.empty() && !kept.count(s.repo)) runningLanes.insert(s.lane);
+    }
+    size_t count = 0;
+    for (auto& s : statements) {
+        bool keep = s.repo.empty() ? !runningLanes.count(s.lane) && (s.lane != "rm" || runningLanes.empty())
+                                   : kept.count(s.repo) > 0;
+        if (!keep) continue;
+        count++;
+        s.fetch = [](vector<string>&) { return Path(); };
+        s.install = [](Path) {};
+        if (s.repo.empty()) continue;
+        s.resolved = lockedByKey[s.key]->resolved;
+        s.install = [repo = s.repo, &installed](Path) {
+            auto it = installed.manifests.find(repo);
+            if (it != installed.manifests.end()) claimInstalled(conflictIndex, repo, it->second, fs::currentPath());
+        };
+    }
+    return count;
+}
+
+void writeLock(const string& spec, map<string, vector<ManifestEntry>>& manifests) {
+    Lockfile lock;
+    lock.spec = spec;
+    for (auto& s : statements) {
+        LockedStatement l;
+        l.key = s.key;
+        l.repo = s.repo;
+        l.resolved = s.resolved;
+        if (!s.repo.empty()) {
+            l.shadowed = conflictIndex.shadowed(s.repo);
+            l.files = manifests[s.repo].size();
+            l.outputs = manifestDigest(manifests[s.repo]);
+        }
+        lock.statements.push_back(l);
+    }
+    lock.save(lockFile);
+}
+
+// what a run changes in the objects of setUp, so that every run of the daemon starts like a new process
+void startRun() {
+    repoCache = new RepoCache(new TmpDir(temp->path()), store);
+    debInstaller->reset();
+    debInstaller->writerThreads = writerThreads();
+    downloader->clearStats();
+    if (store) store->staleBefore = options.update ? unixTime() : 0;
+}
+
+// dep-pull export and import, an export needs a run for the current vendor.txt whose files are intact
+void runBundleCommand(const string& spec) {
+    if (parseFailed) throw std::runtime_error("vendor.txt has errors, nothing to " + options.command);
+    if (options.command == "import") {
+        importBundle(options.bundle, fs::currentPath(), spec, lockFile, options.decompressThreads, writerThreads());
+        return;
+    }
+    Lockfile lock;
+    if (!lock.load(lockFile) || lock.spec != spec)
+        throw std::runtime_error(string(lockFile) + " does not match vendor.txt, run dep-pull first");
+    InstalledState installed = checkInstalled(fs::currentPath(), options.jobs);
+    if (!installed.modified.empty())
+        throw std::runtime_error(
+            "files of (" + *installed.modified.begin() + ") changed since the last run, run dep-pull first"
+        );
+    BundleInfo info;
+    info.spec = spec;
+    info.lock = readWhole(lockFile);
+    exportBundle(
+        options.bundle, fs::currentPath(), info, installed.manifests, int(std::thread::hardware_concurrency())
+    );
+}
+
+// one run in the current directory with the global options
+void runProject() {
+    statements.clear();
+    parseFailed = false;
+    specHash = Sha256();
+    debConfiguration.clear();
+    conflictIndex = ConflictIndex();
+    if (!options.trace.empty() || options.stats) {
+        tracer.enable(!options.trace.empty());
+    } else {
+        tracer.disable();
+    }
+
+    try {
+        StageTimes times;
+        times.measure("parse", [] { parseInclude(Element({Token("include"), Token("vendor.txt")})); });
+        string spec = specHash.hexDigest();
+        if (!options.command.empty()) {
+            times.measure(options.command, [&] { runBundleCommand(spec); });
+            if (options.timings) times.print(cout);
+            statements.clear();
+        }
+
+        // with an unchanged vendor.txt and intact files there is nothing to do, otherwise only the statements that
+        // changed run
+        Lockfile lock;
+        InstalledState installed;
+        size_t kept = 0;
+        if (options.command.empty() && !options.plan && !options.update && !parseFailed && lock.load(lockFile)) {
+            bool upToDate = false;
+            times.measure("check", [&] {
+                installed = checkInstalled(fs::currentPath(), options.jobs);
+                upToDate = lock.spec == spec && lock.statements.size() == statements.size();
+                for (auto& l : lock.statements) upToDate = upToDate && (l.repo.empty() || outputsIntact(l, installed));
+                if (!upToDate) kept = keepLocked(lock, installed);
+            });
+            // the lanes that installed the most files last time start first
+            map<string, uint64_t> lockedFiles;
+            for (auto& l : lock.statements) lockedFiles[l.key] = l.files;
+            for (auto& s : statements) s.weight += int64_t(lockedFiles[s.key]);
+            if (upToDate) {
+                cout << "Up to date with " << lockFile << endl;
+                if (options.timings) times.print(cout);
+                statements.clear();
+            }
+        }
+
+        if (!statements.empty()) {
+            setUp();
+            startRun();
+            if (kept) cout << "Keeping " << kept << " of " << statements.size() << " statements from " << lockFile << endl;
+            if (options.plan) {
+                // only the deb lane (deb-init, deb-ignore, ... and the deb statements that print their plan)
+                vector<VendorStatement> debStatements;
+                for (auto& s : statements)
+                    if (s.lane == "deb") debStatements.push_back(s);
+                runStatements(debStatements, 1);
+            } else {
+                bool ok = runStatements(statements, options.jobs, &times);
+                if (ok && !parseFailed) {
+                    times.measure("manifests", [&] {
+                        auto manifests = updateManifests(conflictIndex, fs::currentPath(), options.jobs);
+                        writeLock(spec, manifests);
+                    });
+                } else {
+                    cout << "[WARNING] some statements failed, stale files of earlier runs are kept" << endl;
+                }
+                downloader->printStats(cout);
+                if (options.timings) times.print(cout);
+            }
+        }
+
+    } catch (std::exception& e) {
+        cout << estd::clearSettings << estd::setTextColor(255, 0, 0);
+        cout << "[ERROR] ";
+        cout << e.what() << estd::clearSettings << endl;
+    }
+
+    // also after a failed run, that is when a trace is most useful
+    try {
+        if (!options.trace.empty()) tracer.write(options.trace);
+        if (options.stats) tracer.printStats(cout);
+    } catch (std::exception& e) { cout << "[WARNING] " << e.what() << endl; }
+
+    // the objects of this run may be evicted by other processes now
+    if (store) store->unpinAll();
+}
+
+// the specHash of a run in directory, without parsing more than the include statements and without changing the
+// working directory, "" when a file can not be read (the run reports it)
+string projectSpec(const string& directory) {
+    Sha256 h;
+    std::function<void(Path, Path)> add = [&](Path prefix, Path name) {
+        Path p = prefix / name;
+        string file = directory + "/" + p.string();
+        auto pt = ParseTreeBuilder().buildParseTree(Tokenizer().tokenize(file));
+        h.update(p.string() + '\0').updateFile(file).update("\0", 1);
+        for (size_t i = 0; i < pt.size(); i++)
+            if (pt[i]->size() == 2 && pt[i][0]->isName() && pt[i][0]->getName() == "include")
+                add(p.getAntiSuffix(), pt[i][1]->getValue());
+    };
     try {
-        srand(time(nullptr));
-        temp = new estd::files::TmpDir();
-        {
-            std::ofstream ff(temp->path() / ".gitignore");
-            ff << "*";
-            ff.close();
+        add("./", "vendor.txt");
+    } catch (std::exception&) { return ""; }
+    return h.hexDigest();
+}
+
+// dep-pull --daemon: every request is a run in the directory of the client with its arguments, requests for the
+// same project with the same arguments and vendor.txt (with its includes) share a run
+void serveDaemon() {
+    setUp();
+    std::filesystem::path home = std::filesystem::current_path();
+    auto run = [home](const DaemonRequest& request) {
+        std::filesystem::current_path(request.directory);
+        try {
+            options = parseArguments(request.args);
+            runProject();
+        } catch (...) {
+            std::filesystem::current_path(home);
+            throw;
         }
-        debInstaller = new deb::Installer(new TmpDir(temp->path()));
-        repoCache = new RepoCache(temp);
-        parseInclude(Element({Token("include"), Token("vendor.txt")}));
+        std::filesystem::current_path(home);
+    };
+    Daemon daemon(options.socket.empty() ? defaultSocketPath() : options.socket, run, projectSpec);
+    daemon.serve();
+}
 
+// sends the run to the daemon if one is configured, false if it has to run here
+bool sendToDaemon(int argc, char** argv) {
+    string socket = options.socket;
+    if (socket.empty() && getenv("DEP_PULL_SOCKET")) socket = defaultSocketPath();
+    if (socket.empty()) return false;
+
+    DaemonRequest request;
+    request.directory = std::filesystem::current_path().string();
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--socket") {
+            i++;
+            continue;
+        }
+        request.args.push_back(argv[i]);
+    }
+    if (runOnDaemon(socket, request, cout)) return true;
+    cout << "[WARNING] no daemon is listening on " << socket << ", running here" << endl;
+    return false;
+}
+
+int main(int argc, char** argv) {
+    try {
+        options = parseArguments(argc, argv);
+        if (options.help) {
+            printUsage();
+            return 0;
+        }
+        scheduler.configure(
+            std::max(16, 2 * options.jobs), int(std::thread::hardware_concurrency()), options.hostConnections
+        );
+        if (options.daemon) {
+            serveDaemon();
+            return 0;
+        }
+        if (sendToDaemon(argc, argv)) return 0;
     } catch (std::exception& e) {
         cout << estd::clearSettings << estd::setTextColor(255, 0, 0);
         cout << "[ERROR] ";
         cout << e.what() << estd::clearSettings << endl;
+        return 0;
     }
 
+    runProject();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "file-installer.hpp"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options {
+    int jobs = std::max(4, int(std::thread::hardware_concurrency()));
+    std::string gitMode = "shallow";
+    std::string tarMode = "stream";
+    InstallMode installMode = InstallMode::automatic;
+    int decompressThreads = std::max(1, int(std::thread::hardware_concurrency()));
+    int hostConnections = 6;
+    bool plan = false;
+    bool update = false;
+    bool timings = false;
+    std::string trace;
+    bool stats = false;
+    bool daemon = false;
+    std::string socket;
+    std::string command; // empty for a normal run, "export" or "import"
+    std::string bundle = "vendor.tar.zst";
+    bool help = false;
+};
+
+inline void printUsage() {
+    std::cout << "usage: dep-pull [options]\n"
+                 "       dep-pull [options] export|import [FILE]\n"
+                 "\n"
+                 "Reads vendor.txt in the current directory and pulls the listed dependencies.\n"
+                 "\n"
+                 "export writes the installed files with dep-pull.lock and the manifests into FILE (default\n"
+                 "vendor.tar.zst), import restores them from FILE without fetching anything if it was exported for\n"
+                 "the same vendor.txt.\n"
+                 "\n"
+                 "  -j, --jobs N   fetch up to N statements at the same time (1 runs everything sequentially)\n"
+                 "  --git-mode M   shallow (default): single revision, blobless, sparse fetches into persistent mirrors\n"
+                 "                 clone: full clone and checkout of every git repository\n"
+                 "  --tar-mode M   stream (default): extract tar archives while they are downloaded\n"
+                 "                 classic: download the whole archive first, then extract it\n"
+                 "  --install-mode M\n"
+                 "                 how files are copied from the cache into the project, each mode falls back to copy:\n"
+                 "                 auto (default): reflink, then copy-range, then copy\n"
+                 "                 reflink: copy on write clone of the cached file\n"
+                 "                 hardlink: share the cached file (do not edit vendored files in place then)\n"
+                 "                 copy-range: in kernel copy_file_range\n"
+                 "                 copy: plain read and write\n"
+                 "  --decompress-threads N\n"
+                 "                 threads used to decompress a single xz, zstd (multi-frame) or gzip (BGZF) archive,\n"
+                 "                 1 decompresses on the extracting thread (default: the number of cores)\n"
+                 "  --host-connections N\n"
+                 "                 open at most N connections to the same host at once (default 6), downloads and\n"
+                 "                 .deb packages beyond that wait while those from other hosts go ahead\n"
+                 "  --plan         only resolve the deb statements and print the packages they would download with\n"
+                 "                 their total size, nothing is installed\n"
+                 "  --update       ignore dep-pull.lock and run every statement, git branches, tarballs and deb\n"
+                 "                 packages are fetched again instead of taken from the cache\n"
+                 "  --timings      print how long each stage of the run took\n"
+                 "  --trace FILE   write a trace of the run (stages of every statement, bytes, files, cache hits and\n"
+                 "                 queue depths) to FILE in the Chrome trace event format, open it in Perfetto\n"
+                 "  --stats        print a summary of the same data at exit\n"
+                 "  --daemon       keep running and serve the runs that clients send to the socket, the HTTP\n"
+                 "                 connections, deb package indexes and caches stay loaded between them\n"
+                 "  --socket PATH  the socket of the daemon (default: $DEP_PULL_SOCKET, $XDG_RUNTIME_DIR/dep-pull.sock\n"
+                 "                 or /tmp/dep-pull-<uid>.sock). Without --daemon, or with DEP_PULL_SOCKET set, the\n"
+                 "                 run is sent to the daemon and its output shown here\n"
+                 "  -h, --help     show this message\n";
+}
+
+inline Options parseArguments(const std::vector<std::string>& args) {
+    Options opt;
+
+    for (size_t i = 0; i < args.size(); i++) {
+        std::string arg = args[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= args.size()) throw std::runtime_error("missing value for " + arg);
+            return args[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            opt.help = true;
+        } else if (arg == "-j" || arg == "--jobs") {
+            opt.jobs = std::stoi(value());
+        } else if (arg == "--git-mode") {
+            opt.gitMode = value();
+            if (opt.gitMode != "shallow" && opt.gitMode != "clone")
+                throw std::runtime_error("--git-mode must be shallow or clone");
+        } else if (arg == "--tar-mode") {
+            opt.tarMode = value();
+            if (opt.tarMode != "stream" && opt.tarMode != "classic")
+                throw std::runtime_error("--tar-mode must be stream or classic");
+        } else if (arg == "--decompress-threads") {
+            opt.decompressThreads = std::stoi(value());
+            if (opt.decompressThreads < 1) throw std::runtime_error("--decompress-threads must be at least 1");
+        } else if (arg == "--host-connections") {
+            opt.hostConnections = std::stoi(value());
+            if (opt.hostConnections < 1) throw std::runtime_error("--host-connections must be at least 1");
+        } else if (arg == "--plan") {
+            opt.plan = true;
+        } else if (arg == "--update") {
+            opt.update = true;
+        } else if (arg == "--timings") {
+            opt.timings = true;
+        } else if (arg == "--trace") {
+            opt.trace = value();
+        } else if (arg == "--stats") {
+            opt.stats = true;
+        } else if (arg == "--daemon") {
+            opt.daemon = true;
+        } else if (arg == "--socket") {
+            opt.socket = value();
+        } else if (arg == "--install-mode") {
+            opt.installMode = parseInstallMode(value());
+        } else if (arg.rfind("-j", 0) == 0 && arg.size() > 2) {
+            opt.jobs = std::stoi(arg.substr(2));
+        } else if ((arg == "export" || arg == "import") && opt.command.empty()) {
+            opt.command = arg;
+            if (i + 1 < args.size() && args[i + 1].rfind("-", 0) != 0) opt.bundle = args[++i];
+        } else {
+            throw std::runtime_error("unknown argument " + arg + " (see --help)");
+        }
+    }
+    if (opt.jobs < 1) throw std::runtime_error("-j must be at least 1");
+    return opt;
+}
+
+inline Options parseArguments(int argc, char** argv) {
+    return parseArguments(std::vector<std::string>(argv + 1, argv + argc));
+}
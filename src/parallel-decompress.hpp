@@ -0,0 +1,413 @@
+#pragma once
+
+#include "scheduler.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bxzstr.hpp>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <istream>
+#include <lzma.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace {
+    inline uint32_t readLe(const std::string& s, size_t at, int bytes) {
+        uint32_t v = 0;
+        for (int i = 0; i < bytes; i++) v |= uint32_t((unsigned char)s[at + i]) << (8 * i);
+        return v;
+    }
+} // namespace
+
+// Decompressing streambuf that spreads the work over threads when the format allows it:
+//  - xz: liblzma's multithreaded decoder
+//  - zstd: archives of several frames (pzstd, zstd --rsyncable, seekable zstd) are cut at frame boundaries, batches
+//    of frames are decoded in parallel and put back together in order
+//  - gzip: BGZF (bgzip) archives, whose members carry their compressed size, are cut and inflated the same way
+// Everything else, and input that does not split well (a single zstd frame of a huge archive, a plain gzip stream),
+// is decoded by bxzstr on the reading thread like before. Memory is bounded by threads batches in flight, the
+// batches are decoded on the cpu lane of the scheduler.
+//
+// The buffer seeks like bxz::istreambuf: forward by decoding and skipping, backward by starting over, which needs a
+// seekable source.
+class ParallelDecompressBuf : public std::streambuf {
+private:
+    // returns prefix first and then whatever is left in source, so format detection can look ahead without seeking
+    class PrefixedBuf : public std::streambuf {
+    private:
+        std::string prefix;
+        std::streambuf* source;
+        bool prefixDone = false;
+        std::vector<char> buffer = std::vector<char>(1 << 16);
+
+    public:
+        PrefixedBuf(std::string prefix, std::streambuf* source) : prefix(std::move(prefix)), source(source) {}
+
+        int_type underflow() override {
+            if (gptr() != egptr()) return traits_type::to_int_type(*gptr());
+            if (!prefixDone) {
+                prefixDone = true;
+                if (!prefix.empty()) {
+                    setg(prefix.data(), prefix.data(), prefix.data() + prefix.size());
+                    return traits_type::to_int_type(*gptr());
+                }
+            }
+            std::streamsize n = source->sgetn(buffer.data(), std::streamsize(buffer.size()));
+            if (n <= 0) return traits_type::eof();
+            setg(buffer.data(), buffer.data(), buffer.data() + n);
+            return traits_type::to_int_type(*gptr());
+        }
+    };
+
+    // xz through liblzma's threaded decoder, it decodes the blocks of archives written by a threaded encoder (xz -T,
+    // dpkg-deb) in parallel and falls back to a single thread for single block files by itself
+    class LzmaMtBuf : public std::streambuf {
+    private:
+        std::unique_ptr<std::streambuf> source;
+        lzma_stream strm = LZMA_STREAM_INIT;
+        std::vector<uint8_t> in = std::vector<uint8_t>(1 << 20);
+        std::vector<char> out = std::vector<char>(1 << 20);
+        bool inputDone = false, streamDone = false;
+
+    public:
+        LzmaMtBuf(std::unique_ptr<std::streambuf> source, int threads) : source(std::move(source)) {
+            lzma_mt mt{};
+            mt.flags = LZMA_CONCATENATED;
+            mt.threads = uint32_t(threads);
+            uint64_t memory = lzma_physmem();
+            mt.memlimit_threading = memory ? memory / 4 : uint64_t(1) << 30;
+            mt.memlimit_stop = UINT64_MAX;
+            if (lzma_stream_decoder_mt(&strm, &mt) != LZMA_OK)
+                throw std::runtime_error("failed to initialize the xz decoder");
+        }
+
+        ~LzmaMtBuf() { lzma_end(&strm); }
+
+        int_type underflow() override {
+            if (gptr() != egptr()) return traits_type::to_int_type(*gptr());
+            strm.next_out = (uint8_t*)out.data();
+            strm.avail_out = out.size();
+            while (!streamDone && strm.avail_out == out.size()) {
+                if (strm.avail_in == 0 && !inputDone) {
+                    std::streamsize n = source->sgetn((char*)in.data(), std::streamsize(in.size()));
+                    strm.next_in = in.data();
+                    strm.avail_in = size_t(std::max<std::streamsize>(n, 0));
+                    inputDone = n <= 0;
+                }
+                lzma_ret ret = lzma_code(&strm, inputDone ? LZMA_FINISH : LZMA_RUN);
+                if (ret == LZMA_STREAM_END) {
+                    streamDone = true;
+                } else if (ret != LZMA_OK) {
+                    throw std::runtime_error("xz: failed to decompress (lzma error " + std::to_string(ret) + ")");
+                }
+            }
+            size_t produced = out.size() - strm.avail_out;
+            if (produced == 0) return traits_type::eof();
+            setg(out.data(), out.data(), out.data() + produced);
+            return traits_type::to_int_type(*gptr());
+        }
+    };
+
+    static constexpr size_t batchSize = 1 << 20;     // compressed bytes per parallel task
+    static constexpr size_t maxFrameSize = 32 << 20; // larger frames are decoded sequentially instead of buffered
+    static constexpr size_t chunkSize = 1 << 20;
+
+    enum class Mode { detect, zstd, bgzf, sequential };
+    enum class Read { ok, end, fallback };
+
+    std::streambuf* source;
+    std::streamoff sourceStart;
+    int threads;
+
+    Mode mode = Mode::detect;
+    std::unique_ptr<PrefixedBuf> input;
+    std::unique_ptr<PrefixedBuf> sequentialInput;
+    std::unique_ptr<std::streambuf> sequential;
+    std::deque<std::future<std::string>> pending;
+    // set for the batches of pending when they are dropped, the ones that did not start yet return at once
+    std::shared_ptr<std::atomic<bool>> cancelled = std::make_shared<std::atomic<bool>>(false);
+    bool inputDone = false;
+
+    std::string current;
+    uint64_t base = 0; // uncompressed offset of current
+
+    bool readInto(std::string& to, size_t n) {
+        size_t old = to.size();
+        to.resize(old + n);
+        std::streamsize got = input->sgetn(to.data() + old, std::streamsize(n));
+        to.resize(old + size_t(std::max<std::streamsize>(got, 0)));
+        return got == std::streamsize(n);
+    }
+
+    // appends one zstd frame to unit, the frame size is only known by walking its block headers
+    Read readZstdFrame(std::string& unit) {
+        size_t begin = unit.size();
+        if (!readInto(unit, 4)) return unit.size() == begin ? Read::end : Read::fallback;
+        uint32_t magic = readLe(unit, begin, 4);
+        if ((magic & 0xfffffff0) == 0x184d2a50) { // skippable frame
+            if (!readInto(unit, 4)) return Read::fallback;
+            uint32_t size = readLe(unit, begin + 4, 4);
+            return size <= maxFrameSize && readInto(unit, size) ? Read::ok : Read::fallback;
+        }
+        if (magic != ZSTD_MAGICNUMBER || !readInto(unit, 1)) return Read::fallback;
+
+        unsigned char descriptor = unit[begin + 4];
+        int contentSizeFlag = descriptor >> 6;
+        bool singleSegment = descriptor & 0x20;
+        bool checksum = descriptor & 0x04;
+        const int dictionaryIdBytes[] = {0, 1, 2, 4};
+        const int contentSizeBytes[] = {singleSegment ? 1 : 0, 2, 4, 8};
+        size_t header = (singleSegment ? 0 : 1) + dictionaryIdBytes[descriptor & 3] + contentSizeBytes[contentSizeFlag];
+        if (!readInto(unit, header)) return Read::fallback;
+
+        bool last = false;
+        while (!last) {
+            size_t at = unit.size();
+            if (!readInto(unit, 3)) return Read::fallback;
+            uint32_t block = readLe(unit, at, 3);
+            last = block & 1;
+            int type = (block >> 1) & 3;
+            if (type == 3) return Read::fallback; // reserved, let the decoder report it
+            if (!readInto(unit, type == 1 ? 1 : block >> 3)) return Read::fallback; // rle blocks store one byte
+            if (unit.size() - begin > maxFrameSize) return Read::fallback;
+        }
+        return !checksum || readInto(unit, 4) ? Read::ok : Read::fallback;
+    }
+
+    // appends one BGZF member to unit, its total size is in the "BC" extra field
+    Read readBgzfMember(std::string& unit) {
+        size_t begin = unit.size();
+        if (!readInto(unit, 12)) return unit.size() == begin ? Read::end : Read::fallback;
+        if ((unsigned char)unit[begin] != 0x1f || (unsigned char)unit[begin + 1] != 0x8b || unit[begin + 2] != 8 ||
+            !(unit[begin + 3] & 0x04))
+            return Read::fallback;
+        uint32_t extraLength = readLe(unit, begin + 10, 2);
+        if (!readInto(unit, extraLength)) return Read::fallback;
+
+        uint32_t blockSize = 0;
+        for (size_t at = begin + 12; at + 4 <= begin + 12 + extraLength;) {
+            uint32_t length = readLe(unit, at + 2, 2);
+            if (unit[at] == 'B' && unit[at + 1] == 'C' && length == 2) blockSize = readLe(unit, at + 4, 2) + 1;
+            at += 4 + length;
+        }
+        if (blockSize < 12 + extraLength + 8) return Read::fallback; // not BGZF after all
+        return readInto(unit, blockSize - 12 - extraLength) ? Read::ok : Read::fallback;
+    }
+
+    // a batch of whole frames of about batchSize bytes
+    Read readBatch(std::string& unit) {
+        while (true) {
+            Read r = mode == Mode::zstd ? readZstdFrame(unit) : readBgzfMember(unit);
+            if (r != Read::ok || unit.size() >= batchSize) return r;
+        }
+    }
+
+    static std::string decodeZstd(std::string unit) {
+        std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        std::string out;
+        ZSTD_inBuffer in{unit.data(), unit.size(), 0};
+        while (in.pos < in.size) {
+            size_t old = out.size();
+            out.resize(old + chunkSize);
+            ZSTD_outBuffer o{out.data() + old, chunkSize, 0};
+            size_t ret = ZSTD_decompressStream(ctx.get(), &o, &in);
+            if (ZSTD_isError(ret)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret));
+            out.resize(old + o.pos);
+        }
+        return out;
+    }
+
+    static std::string decodeGzip(std::string unit) {
+        z_stream strm{};
+        if (inflateInit2(&strm, 15 + 16) != Z_OK) throw std::runtime_error("failed to initialize inflate");
+        std::string out;
+        strm.next_in = (Bytef*)unit.data();
+        strm.avail_in = uInt(unit.size());
+        while (strm.avail_in > 0) {
+            size_t old = out.size();
+            out.resize(old + chunkSize);
+            strm.next_out = (Bytef*)out.data() + old;
+            strm.avail_out = uInt(chunkSize);
+            int ret = inflate(&strm, Z_NO_FLUSH);
+            out.resize(old + chunkSize - strm.avail_out);
+            if (ret == Z_STREAM_END) {
+                inflateReset(&strm); // next member
+            } else if (ret != Z_OK) {
+                inflateEnd(&strm);
+                throw std::runtime_error("gzip: failed to inflate (zlib error " + std::to_string(ret) + ")");
+            }
+        }
+        inflateEnd(&strm);
+        return out;
+    }
+
+    // decode prefix and the rest of the input on this thread
+    void startSequential(std::string prefix) {
+        sequentialInput = std::make_unique<PrefixedBuf>(std::move(prefix), input.get());
+        sequential = std::make_unique<bxz::istreambuf>(sequentialInput.get());
+        mode = Mode::sequential;
+    }
+
+    void detect() {
+        std::string head(6, '\0');
+        head.resize(size_t(std::max<std::streamsize>(source->sgetn(head.data(), 6), 0)));
+        input = std::make_unique<PrefixedBuf>(std::string(), source);
+        if (threads > 1 && head == std::string("\xfd" "7zXZ\0", 6)) {
+            sequential = std::make_unique<LzmaMtBuf>(std::make_unique<PrefixedBuf>(head, source), threads);
+            mode = Mode::sequential;
+        } else if (threads > 1 && head.size() >= 4 && readLe(head, 0, 4) == ZSTD_MAGICNUMBER) {
+            input = std::make_unique<PrefixedBuf>(head, source);
+            mode = Mode::zstd;
+        } else if (threads > 1 && head.size() >= 4 && head.substr(0, 3) == "\x1f\x8b\x08" && (head[3] & 0x04)) {
+            input = std::make_unique<PrefixedBuf>(head, source);
+            mode = Mode::bgzf;
+        } else {
+            startSequential(head);
+        }
+    }
+
+    // keeps up to threads batches decoding
+    void fill() {
+        while ((mode == Mode::zstd || mode == Mode::bgzf) && !inputDone && pending.size() < size_t(threads)) {
+            std::string unit;
+            Read r = readBatch(unit);
+            if (r == Read::fallback) {
+                startSequential(std::move(unit));
+                return;
+            }
+            if (r == Read::end) inputDone = true;
+            if (unit.empty()) return;
+            auto decode = mode == Mode::zstd ? decodeZstd : decodeGzip;
+            auto task = [decode, unit = std::move(unit), cancelled = cancelled]() mutable {
+                return *cancelled ? std::string() : decode(std::move(unit));
+            };
+            pending.push_back(scheduler.async(Lane::cpu, std::move(task)));
+        }
+    }
+
+    // the next piece of decompressed data, false at the end
+    bool next(std::string& out) {
+        if (mode == Mode::detect) detect();
+        while (true) {
+            fill();
+            if (!pending.empty()) {
+                out = pending.front().get();
+                pending.pop_front();
+                if (out.empty()) continue;
+                return true;
+            }
+            if (mode != Mode::sequential) return false;
+            out.resize(chunkSize);
+            out.resize(size_t(std::max<std::streamsize>(sequential->sgetn(out.data(), std::streamsize(chunkSize)), 0)));
+            return !out.empty();
+        }
+    }
+
+    // the futures of Scheduler::async do not wait when they are destroyed, the batches still decoding are waited for
+    // so none of them keeps a cpu thread busy after the buffer moved on
+    void dropPending() {
+        *cancelled = true;
+        for (auto& batch : pending) batch.wait();
+        pending.clear();
+        cancelled = std::make_shared<std::atomic<bool>>(false);
+    }
+
+    void restart() {
+        if (sourceStart < 0) throw std::runtime_error("can not seek back in a compressed stream that is not seekable");
+        dropPending();
+        sequential.reset();
+        sequentialInput.reset();
+        input.reset();
+        mode = Mode::detect;
+        inputDone = false;
+        current.clear();
+        base = 0;
+        setg(nullptr, nullptr, nullptr);
+        if (source->pubseekpos(sourceStart, std::ios_base::in) != std::streampos(sourceStart))
+            throw std::runtime_error("can not seek back in a compressed stream that is not seekable");
+    }
+
+    uint64_t position() const { return base + uint64_t(gptr() - eback()); }
+
+public:
+    ParallelDecompressBuf(std::streambuf* source, int threads)
+        : source(source), sourceStart(source->pubseekoff(0, std::ios_base::cur, std::ios_base::in)),
+          threads(std::max(1, threads)) {}
+
+    ~ParallelDecompressBuf() { dropPending(); }
+
+    int_type underflow() override {
+        while (gptr() == egptr()) {
+            base += current.size();
+            current.clear();
+            setg(nullptr, nullptr, nullptr);
+            if (!next(current)) return traits_type::eof();
+            tracer.count("bytes decompressed", int64_t(current.size()));
+            setg(current.data(), current.data(), current.data() + current.size());
+        }
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char* s, std::streamsize n) override {
+        std::streamsize done = 0;
+        while (done < n) {
+            if (gptr() == egptr() && traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+            std::streamsize k = std::min<std::streamsize>(n - done, egptr() - gptr());
+            std::memcpy(s + done, gptr(), size_t(k));
+            gbump(int(k));
+            done += k;
+        }
+        return done;
+    }
+
+    std::streampos seekoff(std::streamoff off, std::ios_base::seekdir way, std::ios_base::openmode which) override {
+        if (way == std::ios_base::end) return std::streampos(-1);
+        if (way == std::ios_base::cur) off += std::streamoff(position());
+        return seekpos(std::streampos(off), which);
+    }
+
+    std::streampos seekpos(std::streampos pos, std::ios_base::openmode) override {
+        uint64_t target = uint64_t(std::streamoff(pos));
+        if (target < base) restart();
+        while (target > base + current.size()) {
+            setg(eback(), egptr(), egptr());
+            if (traits_type::eq_int_type(underflow(), traits_type::eof())) return std::streampos(-1);
+        }
+        setg(eback(), eback() + (target - base), egptr());
+        return pos;
+    }
+};
+
+// istream over the decompressed contents of a compressed stream or file, see ParallelDecompressBuf
+class ParallelDecompressStream : public std::istream {
+private:
+    std::unique_ptr<std::ifstream> file;
+    std::unique_ptr<ParallelDecompressBuf> buf;
+
+public:
+    ParallelDecompressStream(std::streambuf* compressed, int threads)
+        : std::istream(nullptr), buf(std::make_unique<ParallelDecompressBuf>(compressed, threads)) {
+        rdbuf(buf.get());
+        exceptions(std::ios_base::badbit);
+    }
+
+    ParallelDecompressStream(std::istream& compressed, int threads)
+        : ParallelDecompressStream(compressed.rdbuf(), threads) {}
+
+    ParallelDecompressStream(const std::string& path, int threads)
+        : std::istream(nullptr), file(std::make_unique<std::ifstream>(path, std::ios::in | std::ios::binary)) {
+        if (!*file) throw std::runtime_error("failed to open " + path);
+        buf = std::make_unique<ParallelDecompressBuf>(file->rdbuf(), threads);
+        rdbuf(buf.get());
+        exceptions(std::ios_base::badbit);
+    }
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// The include and exclude globs of a statement, for example include ["include/", "lib/"] exclude ["test/", "*.pdf"].
+// They are matched against paths relative to the copied directory, directories end with a '/'.
+//
+// The syntax is the one of .gitignore: * and ? match within a name, [a-z] is a character class, ** stands for any
+// number of directories. A trailing / only matches directories, a pattern with another / is anchored at the copied
+// directory and one without matches a name at any depth. A path is selected when neither it nor a directory above
+// it matches an exclude and, if there are includes, when it or a directory above it matches one.
+//
+// The patterns are compiled once. Plain names and "*.suffix" patterns, which most of them are, become hash lookups
+// per path component, only the others are matched as globs.
+class PathFilter {
+private:
+    struct Glob {
+        std::vector<std::string> parts; // one per component, "**" for any number of them
+        bool anchored = false;
+        bool directoryOnly = false;
+    };
+
+    struct Patterns {
+        std::vector<std::string> written;
+        std::unordered_set<std::string> names, directoryNames;       // "test", "test/"
+        std::unordered_set<std::string> suffixes, directorySuffixes; // "*.pdf" as ".pdf"
+        std::vector<Glob> globs;
+        bool unanchored = false; // a pattern that can match at any depth
+
+        bool empty() const { return written.empty(); }
+    };
+
+    Patterns include, exclude;
+
+    static bool hasWildcard(std::string_view s) { return s.find_first_of("*?[\\") != std::string_view::npos; }
+
+    static void compile(Patterns& patterns, std::string pattern) {
+        if (pattern.rfind("./", 0) == 0) pattern = pattern.substr(1);
+        if (pattern.empty() || pattern == "/") return;
+        patterns.written.push_back(pattern);
+
+        Glob glob;
+        glob.directoryOnly = pattern.back() == '/';
+        if (glob.directoryOnly) pattern.pop_back();
+        glob.anchored = pattern.find('/') != std::string::npos;
+        if (pattern.front() == '/') pattern = pattern.substr(1);
+
+        if (!glob.anchored) {
+            patterns.unanchored = true;
+            if (!hasWildcard(pattern)) {
+                (glob.directoryOnly ? patterns.directoryNames : patterns.names).insert(pattern);
+                return;
+            }
+            if (pattern.size() > 1 && pattern[0] == '*' && !hasWildcard(pattern.substr(1)) && pattern[1] == '.') {
+                (glob.directoryOnly ? patterns.directorySuffixes : patterns.suffixes).insert(pattern.substr(1));
+                return;
+            }
+        }
+        for (size_t begin = 0; begin <= pattern.size();) {
+            size_t end = std::min(pattern.find('/', begin), pattern.size());
+            if (end > begin) glob.parts.push_back(pattern.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        if (glob.parts.empty()) return;
+        if (glob.parts.front() == "**") patterns.unanchored = true;
+        patterns.globs.push_back(std::move(glob));
+    }
+
+    // glob against a single name, * and ? do not match a '/'
+    static bool matchName(std::string_view glob, std::string_view name) {
+        size_t g = 0, n = 0, starG = std::string_view::npos, starN = 0;
+        while (n < name.size()) {
+            if (g < glob.size() && glob[g] == '*') {
+                starG = g++;
+                starN = n;
+                continue;
+            }
+            if (g < glob.size() && matchChar(glob, g, name[n])) {
+                n++;
+                continue;
+            }
+            if (starG == std::string_view::npos) return false;
+            g = starG + 1;
+            n = ++starN;
+        }
+        while (g < glob.size() && glob[g] == '*') g++;
+        return g == glob.size();
+    }
+
+    // whether the character (or class) at glob[g] matches c, advances g past it if it does
+    static bool matchChar(std::string_view glob, size_t& g, char c) {
+        if (glob[g] == '?') {
+            g++;
+            return true;
+        }
+        if (glob[g] == '\\' && g + 1 < glob.size()) {
+            if (glob[g + 1] != c) return false;
+            g += 2;
+            return true;
+        }
+        if (glob[g] != '[') {
+            if (glob[g] != c) return false;
+            g++;
+            return true;
+        }
+        size_t i = g + 1;
+        bool negated = i < glob.size() && (glob[i] == '!' || glob[i] == '^');
+        if (negated) i++;
+        bool matched = false;
+        for (bool first = true; i < glob.size() && (first || glob[i] != ']'); first = false) {
+            if (i + 2 < glob.size() && glob[i + 1] == '-' && glob[i + 2] != ']') {
+                matched = matched || (c >= glob[i] && c <= glob[i + 2]);
+                i += 3;
+            } else {
+                matched = matched || glob[i] == c;
+                i++;
+            }
+        }
+        if (i >= glob.size()) { // no closing ], a plain '['
+            if (c != '[') return false;
+            g++;
+            return true;
+        }
+        if (matched == negated) return false;
+        g = i + 1;
+        return true;
+    }
+
+    // parts[p..] against components[c..end)
+    static bool matchParts(
+        const std::vector<std::string>& parts, size_t p, const std::vector<std::string_view>& components, size_t c,
+        size_t end
+    ) {
+        if (p == parts.size()) return c == end;
+        if (parts[p] == "**") {
+            for (size_t k = c; k <= end; k++)
+                if (matchParts(parts, p + 1, components, k, end)) return true;
+            return false;
+        }
+        return c < end && matchName(parts[p], components[c]) && matchParts(parts, p + 1, components, c + 1, end);
+    }
+
+    // whether components[0..end) could be the directories above a match of parts
+    static bool matchPrefix(
+        const std::vector<std::string>& parts, size_t p, const std::vector<std::string_view>& components, size_t c,
+        size_t end
+    ) {
+        if (c == end) return true;
+        if (p == parts.size()) return false;
+        if (parts[p] == "**") return true;
+        return matchName(parts[p], components[c]) && matchPrefix(parts, p + 1, components, c + 1, end);
+    }
+
+    static bool hasSuffix(const std::unordered_set<std::string>& suffixes, std::string_view name) {
+        if (suffixes.empty()) return false;
+        for (size_t dot = name.find('.'); dot != std::string_view::npos; dot = name.find('.', dot + 1)) {
+            if (suffixes.count(std::string(name.substr(dot)))) return true;
+        }
+        return false;
+    }
+
+    // whether a pattern matches the path or a directory above it, the last component is a directory if directory
+    static bool matches(const Patterns& patterns, const std::vector<std::string_view>& components, bool directory) {
+        for (size_t i = 0; i < components.size(); i++) {
+            bool isDirectory = directory || i + 1 < components.size();
+            std::string name(components[i]);
+            if (patterns.names.count(name) || hasSuffix(patterns.suffixes, name)) return true;
+            if (isDirectory && (patterns.directoryNames.count(name) || hasSuffix(patterns.directorySuffixes, name)))
+                return true;
+            for (auto& glob : patterns.globs) {
+                if (glob.directoryOnly && !isDirectory) continue;
+                if (glob.anchored ? matchParts(glob.parts, 0, components, 0, i + 1)
+                                  : matchName(glob.parts[0], components[i]))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    static std::vector<std::string_view> split(std::string_view path) {
+        std::vector<std::string_view> components;
+        for (size_t begin = 0; begin < path.size();) {
+            size_t end = std::min(path.find('/', begin), path.size());
+            std::string_view part = path.substr(begin, end - begin);
+            if (!part.empty() && part != ".") components.push_back(part);
+            begin = end + 1;
+        }
+        return components;
+    }
+
+public:
+    PathFilter() = default;
+    PathFilter(const std::vector<std::string>& includes, const std::vector<std::string>& excludes) {
+        for (auto& p : includes) compile(include, p);
+        for (auto& p : excludes) compile(exclude, p);
+    }
+
+    bool empty() const { return include.empty() && exclude.empty(); }
+
+    // path relative to the copied directory, with a trailing '/' for directories
+    bool selected(std::string_view path) const {
+        if (empty()) return true;
+        auto components = split(path);
+        if (components.empty()) return true;
+        bool directory = path.back() == '/';
+        return !matches(exclude, components, directory) &&
+               (include.empty() || matches(include, components, directory));
+    }
+
+    // whether directory or something below it can be selected, the ones it is false for need not be walked into
+    bool mayContain(std::string_view directory) const {
+        if (selected(directory)) return true;
+        auto components = split(directory);
+        if (matches(exclude, components, true)) return false;
+        if (include.unanchored) return true;
+        for (auto& glob : include.globs) {
+            if (matchPrefix(glob.parts, 0, components, 0, components.size())) return true;
+        }
+        return false;
+    }
+
+    // the patterns as written, one "include <pattern>" or "exclude <pattern>" line each
+    std::string describe() const {
+        std::string result;
+        for (auto& p : include.written) result += "include " + p + "\n";
+        for (auto& p : exclude.written) result += "exclude " + p + "\n";
+        return result;
+    }
+
+    // The patterns for a non-cone git sparse checkout of root (an anchored pattern like "/src/" or "/*" for the
+    // whole repository) with this filter applied. Git matches them with the same .gitignore rules.
+    std::vector<std::string> sparsePatterns(std::string root) const {
+        if (root == "/*") root = "/";
+        if (root.back() != '/') return {root}; // a single file
+        auto below = [&](const std::string& pattern) {
+            bool anchored = pattern.find('/') < pattern.size() - 1;
+            std::string p = pattern.front() == '/' ? pattern.substr(1) : pattern;
+            return root + (anchored ? p : "**/" + p);
+        };
+        std::vector<std::string> result;
+        if (include.empty()) result.push_back(root == "/" ? "/*" : root);
+        for (auto& p : include.written) result.push_back(below(p));
+        // a file matching an include would win over an excluded directory above it, so exclude what is inside too
+        for (auto& p : exclude.written) {
+            std::string pattern = below(p);
+            result.push_back("!" + pattern);
+            result.push_back("!" + (pattern.back() == '/' ? pattern : pattern + "/") + "**");
+        }
+        return result;
+    }
+};
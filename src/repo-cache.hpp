@@ -1,10 +1,14 @@
 #pragma once
 
+#include "artifact-store.hpp"
+#include "trace.hpp"
 #include <estd/filesystem.hpp>
 #include <estd/ostream_proxy.hpp>
 #include <estd/ptr.hpp>
 #include <filesystem>
 #include <map>
+#include <mutex>
+#include <set>
 #include <string>
 
 using estd::files::Path;
@@ -18,13 +22,18 @@ private:
     std::map<std::string, Path> cahceDirs;
     std::map<std::string, Path> cahceFiles;
     std::map<std::string, std::set<Path>> cacheSourcePaths;
+    std::map<std::string, std::map<Path, Path>> storeTrees;
     jptr<TmpDir> temp;
+    jptr<ArtifactStore> store;
+    // statements for different repos are fetched concurrently, creation functions run without holding it
+    std::recursive_mutex lock;
     // estd::ostream_proxy dbg{&std::cout};
     estd::ostream_proxy dbg{};
 
 public:
-    RepoCache(jptr<TmpDir> t) : temp(t) {}
+    RepoCache(jptr<TmpDir> t, const jptr<ArtifactStore>& s = nullptr) : temp(t), store(s) {}
     Path access(std::string repo) {
+        std::lock_guard<std::recursive_mutex> l(lock);
         if (cahceDirs.count(repo)) return cahceDirs[repo];
 
         Path p = temp->path() / std::to_string(nextRepoCacheId++);
@@ -34,30 +43,102 @@ public:
         return p;
     }
 
-    bool exists(std::string repo) { return cahceDirs.count(repo); }
+    bool exists(std::string repo) {
+        std::lock_guard<std::recursive_mutex> l(lock);
+        return cahceDirs.count(repo);
+    }
 
-    inline Path createDir(std::string repo, Path sourcePath, std::function<void(Path)> creationFunc) {
+    // the fingerprint is part of the key for statements whose output depends on more than the repoId, pinned trees
+    // of the store never expire
+    inline Path createDir(
+        std::string repo, Path sourcePath, std::function<void(Path)> creationFunc, std::string fingerprint = "",
+        bool pinned = false
+    ) {
+        if (!fingerprint.empty()) repo += "\n" + fingerprint;
+        if (store) return createStoreDir(repo, sourcePath, creationFunc, pinned);
         if (exists(repo)) {
-            for (Path cachedPath : cacheSourcePaths[repo]) {
+            std::set<Path> cachedPaths;
+            {
+                std::lock_guard<std::recursive_mutex> l(lock);
+                cachedPaths = cacheSourcePaths[repo];
+            }
+            for (Path cachedPath : cachedPaths) {
                 if (cachedPath.contains(sourcePath)) {
                     dbg << "cache hit\n";
+                    tracer.count("cache hits", 1);
                     return access(repo);
                 }
             }
             dbg << "cache miss\n";
+            tracer.count("cache misses", 1);
             Path p = access(repo);
             creationFunc(p);
+            std::lock_guard<std::recursive_mutex> l(lock);
             cacheSourcePaths[repo].insert(sourcePath);
             return p;
         }
         dbg << "cache init\n";
+        tracer.count("cache misses", 1);
         Path p = access(repo);
         creationFunc(p);
+        std::lock_guard<std::recursive_mutex> l(lock);
         cacheSourcePaths[repo].insert(sourcePath);
         return p;
     }
 
+    inline Path createStoreDir(
+        std::string repo, Path sourcePath, std::function<void(Path)> creationFunc, bool pinned = false
+    ) {
+        {
+            std::lock_guard<std::recursive_mutex> l(lock);
+            for (auto& [cachedPath, tree] : storeTrees[repo]) {
+                if (Path(cachedPath).contains(sourcePath)) {
+                    dbg << "cache hit\n";
+                    tracer.count("cache hits", 1);
+                    return tree;
+                }
+            }
+        }
+        sptr<Path> tree = store->findTree(repo, sourcePath, pinned);
+        if (tree) {
+            dbg << "persistent cache hit\n";
+            tracer.count("persistent cache hits", 1);
+        } else {
+            dbg << "cache miss\n";
+            tracer.count("cache misses", 1);
+            tree = store->createTree(repo, sourcePath, creationFunc, pinned);
+        }
+        std::lock_guard<std::recursive_mutex> l(lock);
+        storeTrees[repo][sourcePath] = tree.value();
+        return tree.value();
+    }
+
+    // returns the path of a file that creationFunc produced for this repo, only calls it if nothing is cached
+    inline Path createFile(std::string repo, std::function<void(Path)> creationFunc) {
+        if (store) {
+            {
+                std::lock_guard<std::recursive_mutex> l(lock);
+                if (cahceFiles.count(repo)) return cahceFiles[repo];
+            }
+            sptr<Path> file = store->findFile(repo);
+            if (!file) file = store->createFile(repo, creationFunc);
+            std::lock_guard<std::recursive_mutex> l(lock);
+            cahceFiles[repo] = file.value();
+            return file.value();
+        }
+        Path p = getFilePath(repo);
+        if (!std::filesystem::exists(p)) creationFunc(p);
+        return p;
+    }
+
+    // sha256 of a file returned by createFile, files of the store are named after it
+    std::string fileHash(Path file) {
+        if (store) return std::filesystem::path(file.string()).filename().string();
+        return sha256File(file);
+    }
+
     inline Path getFilePath(std::string repo) {
+        std::lock_guard<std::recursive_mutex> l(lock);
         if (cahceFiles.count(repo)) return cahceFiles[repo];
         Path p = temp->path() / std::to_string(nextRepoCacheId++);
         p = p.normalize();
@@ -0,0 +1,297 @@
+#pragma once
+
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Network and disk bound work (downloads, git, copying files) runs on the io lane, decompression and hashing on the
+// cpu lane. Each lane has its own threads, so a burst of downloads waiting on a server does not keep the cores idle
+// and the other way round.
+enum class Lane { io, cpu };
+
+class TaskGroup;
+
+// The one scheduler of a run, every fetch, install, decompress and hash task goes through it.
+//
+// Every worker has its own queue. Tasks submitted by a worker go to its queue, the others are spread over the
+// queues of the lane. A worker takes the task with the highest priority from its own queue and steals the best one
+// from the other queues of its lane when it has nothing to do, equal priorities run in submission order.
+//
+// A task can name a limit: at most limit(key) tasks with the same key run at once, the others wait in the queue
+// while the workers take other tasks. Keys of the form "host <scheme://host>" default to hostLimit, so a mirror
+// with hundreds of packages gets a few connections and the downloads from other hosts still start.
+class Scheduler {
+private:
+    struct Task {
+        std::function<void()> run;
+        int64_t priority = 0;
+        uint64_t sequence = 0;
+        std::string limit;
+        TaskGroup* group = nullptr;
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::vector<Task> tasks;
+    };
+
+    struct LaneState {
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+        std::atomic<int> queued{0};
+        std::atomic<size_t> nextWorker{0};
+        const char* queueName;
+    };
+
+    int threadCount[2] = {16, int(std::max(1u, std::thread::hardware_concurrency()))};
+    int hostLimit = 6;
+    LaneState lanes[2];
+    std::once_flag started;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> sequence{0};
+
+    std::mutex limitLock;
+    std::map<std::string, int> limits;
+    std::map<std::string, int> running;
+
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    uint64_t epoch = 0;
+
+    static thread_local Worker* currentWorker;
+
+    LaneState& lane(Lane l) { return lanes[l == Lane::io ? 0 : 1]; }
+
+    int limitOf(const std::string& key) {
+        auto it = limits.find(key);
+        if (it != limits.end()) return it->second;
+        return key.rfind("host ", 0) == 0 ? hostLimit : INT_MAX;
+    }
+
+    void notify() {
+        {
+            std::lock_guard<std::mutex> l(sleepLock);
+            epoch++;
+        }
+        wake.notify_all();
+    }
+
+    // removes the best task of worker that may run now (and of group, if set), false if there is none
+    bool takeFrom(Worker& worker, Task& task, TaskGroup* group) {
+        std::lock_guard<std::mutex> l(worker.lock);
+        std::lock_guard<std::mutex> ll(limitLock);
+        auto best = worker.tasks.end();
+        for (auto it = worker.tasks.begin(); it != worker.tasks.end(); ++it) {
+            if (group && it->group != group) continue;
+            if (!it->limit.empty() && running[it->limit] >= limitOf(it->limit)) continue;
+            if (best == worker.tasks.end() || it->priority > best->priority ||
+                (it->priority == best->priority && it->sequence < best->sequence)) {
+                best = it;
+            }
+        }
+        if (best == worker.tasks.end()) return false;
+        task = std::move(*best);
+        *best = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        if (!task.limit.empty()) running[task.limit]++;
+        return true;
+    }
+
+    // own queue first, then the queue whose best task has the highest priority
+    bool take(LaneState& state, Worker* own, Task& task, TaskGroup* group = nullptr) {
+        if (own && takeFrom(*own, task, group)) return true;
+        size_t count = state.workers.size();
+        size_t first = state.nextWorker++ % std::max<size_t>(count, 1);
+        for (size_t i = 0; i < count; i++) {
+            Worker& victim = *state.workers[(first + i) % count];
+            if (&victim != own && takeFrom(victim, task, group)) return true;
+        }
+        return false;
+    }
+
+    void execute(LaneState& state, Task& task);
+
+    void workerLoop(LaneState& state, Worker* self) {
+        currentWorker = self;
+        while (true) {
+            uint64_t seen;
+            {
+                std::lock_guard<std::mutex> l(sleepLock);
+                seen = epoch;
+            }
+            Task task;
+            if (take(state, self, task)) {
+                execute(state, task);
+                continue;
+            }
+            std::unique_lock<std::mutex> l(sleepLock);
+            if (stopping) return;
+            wake.wait(l, [&] { return epoch != seen || stopping; });
+            if (stopping && state.queued == 0) return;
+        }
+    }
+
+    void start() {
+        std::call_once(started, [this] {
+            for (int i = 0; i < 2; i++) {
+                lanes[i].queueName = i == 0 ? "io queue" : "cpu queue";
+                for (int k = 0; k < threadCount[i]; k++) lanes[i].workers.push_back(std::make_unique<Worker>());
+                for (int k = 0; k < threadCount[i]; k++) {
+                    lanes[i].threads.emplace_back([this, i, k] { workerLoop(lanes[i], lanes[i].workers[k].get()); });
+                }
+            }
+        });
+    }
+
+    friend class TaskGroup;
+
+    void submit(Lane l, std::function<void()> run, int64_t priority, std::string limit, TaskGroup* group) {
+        start();
+        LaneState& state = lane(l);
+        Worker* target = nullptr;
+        for (auto& w : state.workers) {
+            if (w.get() == currentWorker) target = w.get();
+        }
+        if (!target) target = state.workers[state.nextWorker++ % state.workers.size()].get();
+        {
+            std::lock_guard<std::mutex> lock(target->lock);
+            target->tasks.push_back({std::move(run), priority, sequence++, std::move(limit), group});
+        }
+        tracer.gauge(state.queueName, ++state.queued);
+        notify();
+    }
+
+    // runs a queued task of group on the calling thread, false if none of them can run now
+    bool help(TaskGroup* group) {
+        start();
+        for (auto& state : lanes) {
+            Task task;
+            if (take(state, nullptr, task, group)) {
+                execute(state, task);
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    Scheduler() = default;
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    ~Scheduler() {
+        stopping = true;
+        notify();
+        for (auto& state : lanes) {
+            for (auto& t : state.threads) t.join();
+        }
+    }
+
+    // only before the first task
+    void configure(int ioThreads, int cpuThreads, int connectionsPerHost) {
+        threadCount[0] = std::max(1, ioThreads);
+        threadCount[1] = std::max(1, cpuThreads);
+        hostLimit = std::max(1, connectionsPerHost);
+    }
+
+    void setLimit(const std::string& key, int limit) {
+        {
+            std::lock_guard<std::mutex> l(limitLock);
+            limits[key] = std::max(1, limit);
+        }
+        notify();
+    }
+
+    // runs f on lane and returns its result (or exception) through the future
+    template <class F> auto async(Lane l, F f, int64_t priority = 0) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+        auto future = task->get_future();
+        submit(l, [task] { (*task)(); }, priority, "", nullptr);
+        return future;
+    }
+};
+
+inline thread_local Scheduler::Worker* Scheduler::currentWorker = nullptr;
+
+inline Scheduler scheduler;
+
+// Tasks that belong together, wait() returns when all of them finished. The waiting thread runs queued tasks of
+// the group itself instead of blocking, so a task may wait for the tasks it started without tying up a worker.
+class TaskGroup {
+private:
+    friend class Scheduler;
+
+    Scheduler& owner;
+    std::mutex lock;
+    std::condition_variable done;
+    int pending = 0;
+    std::exception_ptr error;
+
+    void finished(std::exception_ptr e) {
+        std::lock_guard<std::mutex> l(lock);
+        if (e && !error) error = e;
+        if (--pending == 0) done.notify_all();
+    }
+
+public:
+    TaskGroup(Scheduler& owner = scheduler) : owner(owner) {}
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+    ~TaskGroup() {
+        std::unique_lock<std::mutex> l(lock);
+        done.wait(l, [&] { return pending == 0; });
+    }
+
+    // higher priorities run first, limit is a key of Scheduler::setLimit (or a host) or empty
+    void run(Lane lane, std::function<void()> f, int64_t priority = 0, std::string limit = "") {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            pending++;
+        }
+        owner.submit(lane, std::move(f), priority, std::move(limit), this);
+    }
+
+    // rethrows the first exception of a task after all of them finished
+    void wait() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> l(lock);
+                if (pending == 0) break;
+            }
+            if (owner.help(this)) continue;
+            std::unique_lock<std::mutex> l(lock);
+            // a task of the group that waits for a limit can not wake us, so look again now and then
+            done.wait_for(l, std::chrono::milliseconds(5), [&] { return pending == 0; });
+        }
+        std::lock_guard<std::mutex> l(lock);
+        if (error) std::rethrow_exception(std::exchange(error, nullptr));
+    }
+};
+
+inline void Scheduler::execute(LaneState& state, Task& task) {
+    tracer.gauge(state.queueName, --state.queued);
+    std::exception_ptr error;
+    try {
+        task.run();
+    } catch (...) { error = std::current_exception(); }
+    if (!task.limit.empty()) {
+        std::lock_guard<std::mutex> l(limitLock);
+        running[task.limit]--;
+    }
+    if (task.group) task.group->finished(error);
+    notify();
+}
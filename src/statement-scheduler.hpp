@@ -0,0 +1,156 @@
+#pragma once
+
+#include "scheduler.hpp"
+#include "trace.hpp"
+#include <chrono>
+#include <cstdint>
+#include <estd/AnsiEscape.hpp>
+#include <estd/filesystem.hpp>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using estd::files::Path;
+
+// A vendor.txt statement split in two stages. fetch() only touches the cache and may run concurrently with the
+// fetch of any statement in a different lane, install() touches the project tree and always runs in the order the
+// statements were declared (so the first declared file still wins and rm statements apply where they appear).
+struct VendorStatement {
+    std::string description;
+    // statements in the same lane are fetched one after another (same repoId, or shared state like the deb installer)
+    std::string lane;
+    // hash of the statement (and of what else decides what it installs), it is looked up in dep-pull.lock
+    std::string key;
+    // the repo its files are installed as (see copyRepo), empty if it does not install files
+    std::string repo;
+    // how much work the statement is expected to be (the files it installed last time), lanes with more work start
+    // first so the longest one does not start last
+    int64_t weight = 1;
+    // fetch() adds what the statement resolved to (a commit, a checksum) to the list it is given
+    std::function<Path(std::vector<std::string>&)> fetch = [](std::vector<std::string>&) { return Path(); };
+    std::function<void(Path)> install = [](Path) {};
+
+    Path cache;
+    std::vector<std::string> resolved;
+    std::string error;
+    double fetchSeconds = 0;
+};
+
+// wall time of the stages of a run, printed by --timings (one "Stage <name> <seconds>" line each, dep-pull-bench
+// reads them)
+struct StageTimes {
+    std::vector<std::pair<std::string, double>> stages;
+
+    void add(const std::string& name, double seconds) {
+        for (auto& [n, s] : stages) {
+            if (n == name) {
+                s += seconds;
+                return;
+            }
+        }
+        stages.push_back({name, seconds});
+    }
+
+    template <class F> void measure(const std::string& name, F f) {
+        TraceSpan span(name, "run");
+        auto start = std::chrono::steady_clock::now();
+        f();
+        add(name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    void print(std::ostream& out) {
+        for (auto& [name, seconds] : stages) {
+            out << "Stage " << name << " " << std::fixed << std::setprecision(3) << seconds << std::defaultfloat
+                << std::endl;
+        }
+    }
+};
+
+namespace {
+    inline void printStatementError(std::string what) {
+        std::cout << estd::clearSettings << estd::setTextColor(255, 0, 0);
+        std::cout << "[ERROR] ";
+        std::cout << what << estd::clearSettings << std::endl;
+    }
+
+    inline void fetchStatement(VendorStatement& s) {
+        TraceSpan span("fetch statement", "statement", s.description);
+        auto start = std::chrono::steady_clock::now();
+        try {
+            s.cache = s.fetch(s.resolved);
+        } catch (std::exception& e) { s.error = e.what(); }
+        s.fetchSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    inline bool installStatement(VendorStatement& s) {
+        TraceSpan span("install statement", "statement", s.description);
+        try {
+            if (!s.error.empty()) throw std::runtime_error(s.error);
+            s.install(s.cache);
+            return true;
+        } catch (std::exception& e) { printStatementError(e.what()); }
+        return false;
+    }
+} // namespace
+
+// jobs == 1 keeps the old behaviour of fetching and installing each statement before looking at the next one.
+// Returns false if any statement failed. The time spent fetching and installing is added to times.
+inline bool runStatements(std::vector<VendorStatement>& statements, int jobs, StageTimes* times = nullptr) {
+    StageTimes ignored;
+    if (!times) times = &ignored;
+    bool ok = true;
+    if (jobs <= 1) {
+        for (auto& s : statements) {
+            fetchStatement(s);
+            times->add("fetch", s.fetchSeconds);
+            times->measure("install", [&] { ok = installStatement(s) && ok; });
+        }
+        return ok;
+    }
+
+    std::map<std::string, std::vector<VendorStatement*>> lanes;
+    std::vector<std::string> laneOrder;
+    for (auto& s : statements) {
+        if (!lanes.count(s.lane)) laneOrder.push_back(s.lane);
+        lanes[s.lane].push_back(&s);
+    }
+
+    // the lanes are tasks of the shared scheduler, at most jobs of them run at once and the downloads, extractions
+    // and package tasks they start are queued next to those of the other lanes
+    auto start = std::chrono::steady_clock::now();
+    {
+        TraceSpan span("fetch", "run");
+        scheduler.setLimit("statements", jobs);
+        TaskGroup group;
+        for (auto& lane : laneOrder) {
+            auto* chain = &lanes[lane];
+            int64_t weight = 0;
+            for (VendorStatement* s : *chain) weight += s->weight;
+            group.run(
+                Lane::io, [chain] {
+                    for (VendorStatement* s : *chain) fetchStatement(*s);
+                },
+                weight, "statements"
+            );
+        }
+        group.wait();
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double sequential = 0;
+    for (auto& s : statements) sequential += s.fetchSeconds;
+
+    times->add("fetch", wall);
+    times->measure("install", [&] {
+        for (auto& s : statements) ok = installStatement(s) && ok;
+    });
+
+    std::cout << "Fetched " << statements.size() << " statements in " << std::fixed << std::setprecision(2) << wall
+              << "s with -j " << jobs << " (" << sequential << "s sequentially, "
+              << (wall > 0 ? sequential / wall : 1.0) << "x speedup)" << std::defaultfloat << std::endl;
+    return ok;
+}
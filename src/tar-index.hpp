@@ -0,0 +1,384 @@
+#pragma once
+
+#include <array>
+#include <bxzstr.hpp>
+#include <cstdlib>
+#include <estd/filesystem.hpp>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <lzma.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tar/tar.hpp>
+#include <vector>
+#define ZSTD_STATIC_LINKING_ONLY // ZSTD_getFrameHeader
+#include <zstd.h>
+
+using estd::files::Path;
+
+enum class ArchiveFormat { plain, gzip, bzip2, xz, zstd };
+
+// a position in the compressed file where decoding can start from scratch
+struct TarCheckpoint {
+    uint64_t compressed;
+    uint64_t uncompressed;
+    uint32_t check = 0; // xz only, the integrity check of the stream the block belongs to
+};
+
+namespace {
+    inline ArchiveFormat detectArchiveFormat(Path archive) {
+        std::array<unsigned char, 6> magic = {};
+        std::ifstream f(archive.string(), std::ios::in | std::ios::binary);
+        f.read((char*)magic.data(), magic.size());
+        auto starts = [&](std::vector<unsigned char> m) { return std::equal(m.begin(), m.end(), magic.begin()); };
+        if (starts({0x1f, 0x8b})) return ArchiveFormat::gzip;
+        if (starts({'B', 'Z', 'h'})) return ArchiveFormat::bzip2;
+        if (starts({0xfd, '7', 'z', 'X', 'Z', 0x00})) return ArchiveFormat::xz;
+        if (starts({0x28, 0xb5, 0x2f, 0xfd})) return ArchiveFormat::zstd;
+        return ArchiveFormat::plain;
+    }
+
+    // every frame of a zstd file can be decoded on its own, as long as all frames record their size. Only the frame
+    // and block headers are read, the blocks in between are skipped.
+    inline std::vector<TarCheckpoint> findZstdCheckpoints(Path archive) {
+        std::ifstream f(archive.string(), std::ios::in | std::ios::binary);
+        uint64_t fileSize = std::filesystem::file_size(archive.string());
+        auto readAt = [&](uint64_t offset, char* data, size_t length) {
+            f.clear();
+            f.seekg(std::streamoff(offset));
+            f.read(data, std::streamsize(length));
+            return size_t(f.gcount());
+        };
+
+        std::vector<TarCheckpoint> result;
+        uint64_t compressed = 0, uncompressed = 0;
+        while (compressed < fileSize) {
+            char header[ZSTD_FRAMEHEADERSIZE_MAX];
+            size_t length = readAt(compressed, header, sizeof(header));
+            ZSTD_frameHeader frame;
+            if (ZSTD_getFrameHeader(&frame, header, length) != 0) return {};
+            if (frame.frameType == ZSTD_skippableFrame) {
+                compressed += ZSTD_SKIPPABLEHEADERSIZE + frame.frameContentSize;
+                continue;
+            }
+            if (frame.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN) return {};
+
+            uint64_t end = compressed + frame.headerSize;
+            for (bool last = false; !last;) {
+                unsigned char block[3];
+                if (readAt(end, (char*)block, sizeof(block)) != sizeof(block)) return {};
+                uint32_t blockHeader = uint32_t(block[0]) | uint32_t(block[1]) << 8 | uint32_t(block[2]) << 16;
+                last = blockHeader & 1;
+                uint32_t type = (blockHeader >> 1) & 3;
+                if (type == 3) return {}; // reserved
+                end += sizeof(block) + (type == 1 ? 1 : blockHeader >> 3); // an RLE block stores its byte once
+            }
+            if (frame.checksumFlag) end += 4;
+            if (end > fileSize) return {};
+
+            result.push_back({compressed, uncompressed});
+            uncompressed += frame.frameContentSize;
+            compressed = end;
+        }
+        return result;
+    }
+
+    // xz files end with an index of their blocks, every block can be decoded on its own
+    inline std::vector<TarCheckpoint> findXzCheckpoints(Path archive) {
+        std::ifstream f(archive.string(), std::ios::in | std::ios::binary);
+        uint64_t fileSize = std::filesystem::file_size(archive.string());
+
+        lzma_stream strm = LZMA_STREAM_INIT;
+        lzma_index* index = nullptr;
+        if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, fileSize) != LZMA_OK) return {};
+
+        std::vector<uint8_t> buffer(1 << 16);
+        lzma_ret ret = LZMA_OK;
+        while (ret == LZMA_OK) {
+            if (strm.avail_in == 0) {
+                f.read((char*)buffer.data(), buffer.size());
+                strm.next_in = buffer.data();
+                strm.avail_in = f.gcount();
+            }
+            ret = lzma_code(&strm, LZMA_RUN);
+            if (ret == LZMA_SEEK_NEEDED) {
+                f.clear();
+                f.seekg(strm.seek_pos);
+                strm.avail_in = 0;
+                ret = LZMA_OK;
+            }
+        }
+        lzma_end(&strm);
+
+        std::vector<TarCheckpoint> result;
+        if (ret == LZMA_STREAM_END && index) {
+            lzma_index_iter iter;
+            lzma_index_iter_init(&iter, index);
+            while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+                result.push_back({
+                    iter.block.compressed_file_offset,
+                    iter.block.uncompressed_file_offset,
+                    uint32_t(iter.stream.flags->check),
+                });
+            }
+        }
+        if (index) lzma_index_end(index, nullptr);
+        return result;
+    }
+} // namespace
+
+// Seekable view of the uncompressed contents of a zstd or xz file. A seek restarts the decoder at the closest
+// checkpoint before the target (unless decoding forward from the current position is closer), so reading a member
+// in the middle of a large archive only decompresses one frame/block worth of data before it.
+class CheckpointBuf : public std::streambuf {
+private:
+    std::ifstream file;
+    ArchiveFormat format;
+    std::vector<TarCheckpoint> checkpoints;
+    uint64_t size;
+
+    size_t block = 0;        // checkpoint the decoder was started at (xz decodes one block at a time)
+    uint64_t bufferStart = 0; // uncompressed offset of eback()
+    std::vector<char> out = std::vector<char>(1 << 16);
+    std::vector<uint8_t> in = std::vector<uint8_t>(1 << 16);
+    size_t inPos = 0, inLength = 0;
+    bool inEnd = false;
+
+    std::unique_ptr<ZSTD_DStream, decltype(&ZSTD_freeDStream)> zstd{nullptr, &ZSTD_freeDStream};
+    lzma_stream lzma = LZMA_STREAM_INIT;
+    // the block decoder keeps pointers to these until it is ended
+    lzma_block lzmaBlock = {};
+    lzma_filter lzmaFilters[LZMA_FILTERS_MAX + 1] = {{LZMA_VLI_UNKNOWN, nullptr}};
+    bool blockDone = false;
+
+    void endLzma() {
+        lzma_end(&lzma);
+        lzma = LZMA_STREAM_INIT;
+        for (size_t i = 0; lzmaFilters[i].id != LZMA_VLI_UNKNOWN; i++) free(lzmaFilters[i].options);
+        lzmaFilters[0] = {LZMA_VLI_UNKNOWN, nullptr};
+    }
+
+    bool fillInput() {
+        if (inPos < inLength) return true;
+        if (inEnd) return false;
+        file.read((char*)in.data(), in.size());
+        inPos = 0;
+        inLength = file.gcount();
+        if (inLength == 0) inEnd = true;
+        return inLength > 0;
+    }
+
+    void startAt(size_t checkpoint) {
+        block = checkpoint;
+        file.clear();
+        file.seekg(checkpoints[block].compressed);
+        inPos = inLength = 0;
+        inEnd = false;
+        blockDone = false;
+        bufferStart = checkpoints[block].uncompressed;
+        setg(out.data(), out.data(), out.data());
+
+        if (format == ArchiveFormat::zstd) {
+            if (!zstd) zstd.reset(ZSTD_createDStream());
+            ZSTD_DCtx_reset(zstd.get(), ZSTD_reset_session_only);
+            return;
+        }
+
+        // an xz block starts with a header that describes its filters
+        endLzma();
+        uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+        file.read((char*)header, 1);
+        lzmaBlock = {};
+        lzmaBlock.version = 1;
+        lzmaBlock.check = lzma_check(checkpoints[block].check);
+        lzmaBlock.filters = lzmaFilters;
+        lzmaBlock.header_size = lzma_block_header_size_decode(header[0]);
+        file.read((char*)header + 1, lzmaBlock.header_size - 1);
+        if (!file || lzma_block_header_decode(&lzmaBlock, nullptr, header) != LZMA_OK)
+            throw std::runtime_error("xz: invalid block header at " + std::to_string(checkpoints[block].compressed));
+        if (lzma_block_decoder(&lzma, &lzmaBlock) != LZMA_OK)
+            throw std::runtime_error("xz: could not start block decoder");
+    }
+
+    // decodes the next piece of data into out, returns the number of bytes produced
+    size_t decode() {
+        while (true) {
+            if (format == ArchiveFormat::xz && blockDone) {
+                if (block + 1 >= checkpoints.size()) return 0;
+                startAt(block + 1);
+            }
+            if (!fillInput()) return 0;
+
+            size_t produced = 0;
+            if (format == ArchiveFormat::zstd) {
+                ZSTD_inBuffer input = {in.data(), inLength, inPos};
+                ZSTD_outBuffer output = {out.data(), out.size(), 0};
+                size_t ret = ZSTD_decompressStream(zstd.get(), &output, &input);
+                if (ZSTD_isError(ret)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret));
+                inPos = input.pos;
+                produced = output.pos;
+            } else {
+                lzma.next_in = in.data() + inPos;
+                lzma.avail_in = inLength - inPos;
+                lzma.next_out = (uint8_t*)out.data();
+                lzma.avail_out = out.size();
+                lzma_ret ret = lzma_code(&lzma, LZMA_RUN);
+                if (ret == LZMA_STREAM_END) blockDone = true;
+                else if (ret != LZMA_OK) throw std::runtime_error("xz: decoding failed with " + std::to_string(ret));
+                inPos = inLength - lzma.avail_in;
+                produced = out.size() - lzma.avail_out;
+            }
+            if (produced > 0) return produced;
+        }
+    }
+
+    uint64_t cursor() { return bufferStart + (gptr() - eback()); }
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        bufferStart += egptr() - eback();
+        size_t produced = decode();
+        setg(out.data(), out.data(), out.data() + produced);
+        if (produced == 0) return traits_type::eof();
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streampos seekpos(std::streampos sp, std::ios_base::openmode = std::ios_base::in) override {
+        uint64_t pos = sp;
+        if (sp < 0 || pos > size) return std::streampos(-1);
+        if (pos >= bufferStart && pos <= bufferStart + (egptr() - eback())) {
+            setg(eback(), eback() + (pos - bufferStart), egptr());
+            return sp;
+        }
+
+        size_t target = 0;
+        while (target + 1 < checkpoints.size() && checkpoints[target + 1].uncompressed <= pos) target++;
+        // restart unless we are already past the checkpoint and before the target
+        if (cursor() > pos || cursor() < checkpoints[target].uncompressed) startAt(target);
+
+        while (pos >= bufferStart + (egptr() - eback())) {
+            setg(eback(), egptr(), egptr());
+            if (underflow() == traits_type::eof()) return std::streampos(-1);
+        }
+        setg(eback(), eback() + (pos - bufferStart), egptr());
+        return sp;
+    }
+
+    std::streampos seekoff(
+        std::streamoff off, std::ios_base::seekdir way, std::ios_base::openmode which = std::ios_base::in
+    ) override {
+        if (way == std::ios_base::beg) return seekpos(off, which);
+        if (way == std::ios_base::cur) return seekpos(cursor() + off, which);
+        return seekpos(size + off, which);
+    }
+
+public:
+    CheckpointBuf(Path archive, ArchiveFormat format, std::vector<TarCheckpoint> checkpoints, uint64_t size) :
+        file(archive.string(), std::ios::in | std::ios::binary), format(format), checkpoints(checkpoints), size(size) {
+        if (!file) throw std::runtime_error("could not open " + archive.string());
+        if (checkpoints.empty()) throw std::runtime_error("no checkpoints for " + archive.string());
+        startAt(0);
+    }
+
+    ~CheckpointBuf() { endLzma(); }
+};
+
+// Archive metadata kept next to a cached archive: the member table of the tar and where the decompressor can be
+// restarted. zstd frames and xz blocks are used directly; gzip and bzip2 have no usable restart points, so small
+// archives of those kinds are reopened from a decompressed copy instead.
+class TarIndex {
+private:
+    static const uint64_t maxPlainCopy = 256 << 20;
+
+    Path archive;
+    std::string archiveName;
+    uint64_t archiveSize = 0;
+    ArchiveFormat format = ArchiveFormat::plain;
+    std::vector<TarCheckpoint> checkpoints;
+    uint64_t tarSize = 0;
+    std::string members;
+
+    std::unique_ptr<std::streambuf> buffer;
+    std::unique_ptr<std::istream> stream;
+
+public:
+    // builds the index of archive from the member table of a reader that read it once
+    TarIndex(Path archive, const std::vector<tar::IndexEntry>& entries) : archive(archive) {
+        archiveName = archive.getSuffix();
+        archiveSize = std::filesystem::file_size(archive.string());
+        format = detectArchiveFormat(archive);
+        if (format == ArchiveFormat::zstd) checkpoints = findZstdCheckpoints(archive);
+        if (format == ArchiveFormat::xz) checkpoints = findXzCheckpoints(archive);
+        for (auto& e : entries) tarSize = std::max(tarSize, e.offset + e.size);
+
+        std::stringstream ss;
+        tar::Reader::saveIndex(ss, entries);
+        members = ss.str();
+    }
+
+    // loads a saved index, valid() tells if it still describes archive
+    TarIndex(Path archive, Path indexFile) : archive(archive) {
+        std::ifstream f(indexFile.string(), std::ios::in | std::ios::binary);
+        std::string magic;
+        int version, formatId;
+        size_t count;
+        if (!(f >> magic >> version) || magic != "dep-pull-tar-index" || version != 2) return;
+        f >> archiveName >> archiveSize >> formatId >> tarSize >> count;
+        format = ArchiveFormat(formatId);
+        for (size_t i = 0; i < count; i++) {
+            TarCheckpoint c;
+            f >> c.compressed >> c.uncompressed >> c.check;
+            checkpoints.push_back(c);
+        }
+        f.get();
+        members = std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    }
+
+    bool valid() {
+        std::error_code ec;
+        return !members.empty() && archiveName == archive.getSuffix() &&
+               archiveSize == std::filesystem::file_size(archive.string(), ec);
+    }
+
+    void save(Path indexFile) {
+        std::ofstream f(indexFile.string(), std::ios::out | std::ios::binary);
+        // version 2: member permissions come from the mode in the tar headers
+        f << "dep-pull-tar-index 2\n"
+          << archiveName << " " << archiveSize << " " << int(format) << " " << tarSize << " " << checkpoints.size()
+          << "\n";
+        for (auto& c : checkpoints) f << c.compressed << " " << c.uncompressed << " " << c.check << "\n";
+        f << members;
+    }
+
+    bool needsPlainCopy() {
+        return (format == ArchiveFormat::gzip || format == ArchiveFormat::bzip2) && tarSize <= maxPlainCopy;
+    }
+
+    // a seekable stream of the uncompressed tar, plainCopy returns the path of a decompressed copy of the archive
+    // (and is only called for needsPlainCopy() archives)
+    std::istream& open(std::function<Path()> plainCopy) {
+        if (format == ArchiveFormat::plain) {
+            buffer = std::make_unique<std::filebuf>();
+            ((std::filebuf*)buffer.get())->open(archive.string(), std::ios::in | std::ios::binary);
+        } else if (!checkpoints.empty()) {
+            buffer = std::make_unique<CheckpointBuf>(archive, format, checkpoints, tarSize);
+        } else if (needsPlainCopy()) {
+            buffer = std::make_unique<std::filebuf>();
+            ((std::filebuf*)buffer.get())->open(plainCopy().string(), std::ios::in | std::ios::binary);
+        } else { // no restart points, seeking forward still skips the data without parsing it
+            stream = std::make_unique<bxz::ifstream>(archive.string());
+            return *stream;
+        }
+        stream = std::make_unique<std::istream>(buffer.get());
+        return *stream;
+    }
+
+    // reader has to read from the stream returned by open()
+    void loadInto(tar::Reader& reader) {
+        std::stringstream ss(members);
+        reader.loadIndex(ss);
+    }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "parallel-decompress.hpp"
+#include "trace.hpp"
+#include <estd/filesystem.hpp>
+#include <estd/thread_safe_queue.h>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <tar/tar.hpp>
+#include <thread>
+#include <vector>
+
+using estd::files::Path;
+
+// Read side of a bounded queue of downloaded chunks. Blocks until the downloader delivers more data and reports the
+// end of the stream once the queue is closed. It can not seek, which is fine for tar::Reader::streamPath.
+class ChunkQueueBuf : public std::streambuf {
+private:
+    estd::thread_safe_queue<std::string>& queue;
+    std::string current;
+
+public:
+    ChunkQueueBuf(estd::thread_safe_queue<std::string>& queue) : queue(queue) {}
+
+    int_type underflow() override {
+        while (gptr() == egptr()) {
+            try {
+                current = queue.pop();
+            } catch (estd::thread_safe_queue_error&) { return traits_type::eof(); }
+            setg(current.data(), current.data(), current.data() + current.size());
+        }
+        return traits_type::to_int_type(*gptr());
+    }
+
+    // consume whatever is left so a producer blocked on the full queue can finish
+    void drain() {
+        try {
+            while (true) queue.pop();
+        } catch (estd::thread_safe_queue_error&) {}
+    }
+};
+
+// Download, decompression and extraction of a tar archive as three overlapping stages: the downloader (the calling
+// thread) writes every chunk to archive and pushes it into a bounded queue, a second thread decompresses and
+// extracts source into destination from that queue. Memory use is bounded by the queue, and the total time is about
+// the time of the slowest stage instead of the sum of all three.
+//
+// Returns false if the archive could not be extracted in one pass (an error in the stream, or links that point to
+// members outside of source), archive is always complete afterwards so the caller can use extractPath on it.
+// On success entries holds the member table of the archive. Decompression uses up to decompressThreads threads and
+// writerThreads threads write the files, members that filter rejects are skipped (see tar::Reader::memberFilter).
+inline bool streamTar(
+    std::function<void(std::function<void(const char*, size_t)>)> download,
+    Path archive,
+    Path source,
+    Path destination,
+    std::vector<tar::IndexEntry>& entries,
+    int decompressThreads,
+    unsigned writerThreads,
+    std::function<bool(const std::string&)> filter = {}
+) {
+    static const size_t chunkSize = 1 << 16;
+    static const int maxChunks = 64; // 4MiB in flight at most
+
+    estd::thread_safe_queue<std::string> queue(maxChunks);
+    bool extracted = false;
+
+    std::thread extractor([&] {
+        ChunkQueueBuf buf(queue);
+        try {
+            TraceSpan span("stream extract", "tar", archive.string());
+            ParallelDecompressStream zStream(&buf, decompressThreads);
+            tar::Reader r(zStream);
+            r.writerThreads = writerThreads;
+            r.memberFilter = filter;
+            extracted = r.streamPath(source, destination);
+            entries = r.getIndex();
+            traceWritten(r);
+        } catch (std::exception&) { extracted = false; }
+        buf.drain();
+    });
+
+    std::exception_ptr downloadError;
+    try {
+        std::ofstream file(archive.string(), std::ios::out | std::ios::binary);
+        std::string pending;
+        pending.reserve(chunkSize);
+        download([&](const char* data, size_t length) {
+            file.write(data, length);
+            pending.append(data, length);
+            if (pending.size() >= chunkSize) {
+                queue.push(std::move(pending));
+                pending = std::string();
+                pending.reserve(chunkSize);
+            }
+        });
+        if (!pending.empty()) queue.push(std::move(pending));
+        file.close();
+    } catch (...) { downloadError = std::current_exception(); }
+
+    queue.close();
+    extractor.join();
+    if (downloadError) std::rethrow_exception(downloadError);
+    return extracted;
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+inline std::string formatSize(uint64_t bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double size = double(bytes);
+    int unit = 0;
+    while (size >= 1024 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << size << " " << units[unit];
+    return ss.str();
+}
+
+// Records where a run spends its time, for --trace (a Chrome trace event file, opened by Perfetto or
+// chrome://tracing) and --stats (a summary table at exit).
+//
+// Spans are stages of the run or of a statement on one thread (nested spans show what a stage consists of), counters
+// add up (bytes downloaded, files written, cache hits) and gauges follow a current value (the queue depth of the
+// scheduler lanes). Until enable() is called every call returns after checking one atomic flag.
+class Tracer {
+public:
+    struct SpanTotals {
+        uint64_t count = 0;
+        double seconds = 0;
+        double longest = 0;
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr double sampleInterval = 10000; // microseconds between two trace events of the same counter
+
+    struct Event {
+        char phase; // 'X' complete span, 'C' counter
+        std::string name;
+        std::string category;
+        int thread = 0;
+        double begin = 0; // microseconds since the start of the run
+        double duration = 0;
+        int64_t value = 0;
+    };
+
+    struct Series {
+        int64_t value = 0;
+        int64_t peak = 0;
+        double lastSample = -sampleInterval;
+        bool gauge = false;
+    };
+
+    std::atomic<bool> on{false};
+    bool recordEvents = false;
+    Clock::time_point start = Clock::now();
+    std::mutex lock;
+    std::vector<Event> events;
+    std::map<std::thread::id, int> threads;
+    std::vector<std::pair<std::string, SpanTotals>> spans;   // in the order they were first seen
+    std::vector<std::pair<std::string, Series>> series;
+
+    template <class T> static T& entry(std::vector<std::pair<std::string, T>>& list, const std::string& name) {
+        for (auto& [n, value] : list)
+            if (n == name) return value;
+        list.push_back({name, T()});
+        return list.back().second;
+    }
+
+    int threadNumber() {
+        auto [it, inserted] = threads.insert({std::this_thread::get_id(), int(threads.size()) + 1});
+        return it->second;
+    }
+
+    void sample(const std::string& name, Series& s, double time, bool force) {
+        if (!recordEvents || (!force && time - s.lastSample < sampleInterval)) return;
+        s.lastSample = time;
+        events.push_back({'C', name, "", 0, time, 0, s.value});
+    }
+
+    static std::string json(const std::string& s) {
+        std::string result = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            } else if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                result += escaped;
+            } else {
+                result += c;
+            }
+        }
+        return result + "\"";
+    }
+
+public:
+    // events: keep every span and counter change for write(), otherwise only the totals for printStats(). Forgets
+    // what an earlier enable() recorded.
+    void enable(bool events) {
+        std::lock_guard<std::mutex> l(lock);
+        recordEvents = events;
+        start = Clock::now();
+        this->events.clear();
+        threads.clear();
+        spans.clear();
+        series.clear();
+        on = true;
+    }
+
+    void disable() { on = false; }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    double now() const { return std::chrono::duration<double, std::micro>(Clock::now() - start).count(); }
+
+    // a span of name that started at begin (see now()), detail tells it apart in the trace (a url, a statement)
+    void span(const std::string& name, const std::string& category, const std::string& detail, double begin) {
+        if (!enabled()) return;
+        double end = now();
+        std::lock_guard<std::mutex> l(lock);
+        auto& totals = entry(spans, name);
+        totals.count++;
+        totals.seconds += (end - begin) / 1e6;
+        totals.longest = std::max(totals.longest, (end - begin) / 1e6);
+        if (recordEvents)
+            events.push_back({'X', detail.empty() ? name : name + " " + detail, category, threadNumber(), begin, end - begin});
+    }
+
+    void count(const std::string& name, int64_t delta) {
+        if (!enabled() || delta == 0) return;
+        double time = now();
+        std::lock_guard<std::mutex> l(lock);
+        auto& s = entry(series, name);
+        s.value += delta;
+        s.peak = std::max(s.peak, s.value);
+        sample(name, s, time, false);
+    }
+
+    void gauge(const std::string& name, int64_t value) {
+        if (!enabled()) return;
+        double time = now();
+        std::lock_guard<std::mutex> l(lock);
+        auto& s = entry(series, name);
+        s.gauge = true;
+        if (s.value == value && s.lastSample >= 0) return;
+        s.value = value;
+        s.peak = std::max(s.peak, value);
+        sample(name, s, time, true);
+    }
+
+    // writes the trace in the Chrome trace event format (JSON object with a traceEvents array)
+    void write(const std::string& file) {
+        std::lock_guard<std::mutex> l(lock);
+        double end = now();
+        for (auto& [name, s] : series) sample(name, s, end, true);
+
+        std::ofstream out(file);
+        if (!out) throw std::runtime_error("failed to create " + file);
+        out << std::fixed << std::setprecision(1) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"dep-pull\"}}";
+        for (auto& [id, number] : threads) {
+            out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << number << ",\"args\":{\"name\":"
+                << json(number == 1 ? "main" : "thread " + std::to_string(number)) << "}}";
+        }
+        for (auto& e : events) {
+            if (e.phase == 'X') {
+                out << ",\n{\"name\":" << json(e.name) << ",\"cat\":" << json(e.category)
+                    << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread << ",\"ts\":" << e.begin
+                    << ",\"dur\":" << e.duration << "}";
+            } else {
+                out << ",\n{\"name\":" << json(e.name) << ",\"ph\":\"C\",\"pid\":1,\"ts\":" << e.begin
+                    << ",\"args\":{\"value\":" << e.value << "}}";
+            }
+        }
+        out << "\n]}\n";
+    }
+
+    void printStats(std::ostream& out) {
+        std::lock_guard<std::mutex> l(lock);
+        out << std::left << std::setw(28) << "stage" << std::right << std::setw(8) << "count" << std::setw(12)
+            << "total" << std::setw(12) << "longest" << "\n";
+        out << std::fixed << std::setprecision(3);
+        for (auto& [name, t] : spans) {
+            out << std::left << std::setw(28) << name << std::right << std::setw(8) << t.count << std::setw(11)
+                << t.seconds << "s" << std::setw(11) << t.longest << "s\n";
+        }
+        out << std::defaultfloat;
+        for (bool gauges : {false, true}) {
+            bool any = false;
+            for (auto& [name, s] : series) {
+                if (s.gauge != gauges) continue;
+                if (!any) out << "\n" << std::left << std::setw(28) << (gauges ? "queue" : "counter") << std::right
+                              << std::setw(12) << (gauges ? "peak" : "total") << "\n";
+                any = true;
+                int64_t shown = gauges ? s.peak : s.value;
+                out << std::left << std::setw(28) << name << std::right << std::setw(12)
+                    << (name.rfind("bytes", 0) == 0 ? formatSize(uint64_t(shown)) : std::to_string(shown)) << "\n";
+            }
+        }
+        out << std::flush;
+    }
+};
+
+inline Tracer tracer;
+
+// Adds a span from its construction to its destruction to the tracer.
+class TraceSpan {
+private:
+    std::string name;
+    std::string category;
+    std::string detail;
+    double begin = 0;
+    bool active;
+
+public:
+    TraceSpan(std::string name, std::string category, std::string detail = "") : active(tracer.enabled()) {
+        if (!active) return;
+        this->name = std::move(name);
+        this->category = std::move(category);
+        this->detail = std::move(detail);
+        begin = tracer.now();
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan() {
+        if (active) tracer.span(name, category, detail, begin);
+    }
+};
+
+// adds the files a tar::Reader extracted to the "files written" and "bytes written" counters
+template <class Reader> void traceWritten(const Reader& r) {
+    tracer.count("files written", int64_t(r.filesWritten));
+    tracer.count("bytes written", int64_t(r.bytesWritten));
+}